@@ -0,0 +1,122 @@
+#include "Coverage.h"
+
+//Standard includes
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSE41
+#define TARGET_AVX2
+#else
+#include <cpuid.h>
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+using namespace dae;
+
+namespace
+{
+	uint32_t CoverageScalar(const BlockEdges& edges)
+	{
+		uint32_t mask{};
+		for (int i{}; i < BLOCK_PIXELS; ++i) {
+			const int dx{ i % BLOCK_WIDTH };
+			const int dy{ i / BLOCK_WIDTH };
+
+			const int32_t w0{ edges.origin[0] + edges.stepX[0] * dx + edges.stepY[0] * dy };
+			const int32_t w1{ edges.origin[1] + edges.stepX[1] * dx + edges.stepY[1] * dy };
+			const int32_t w2{ edges.origin[2] + edges.stepX[2] * dx + edges.stepY[2] * dy };
+
+			if ((w0 | w1 | w2) >= 0) {
+				mask |= 1u << i;
+			}
+		}
+		return mask;
+	}
+
+	TARGET_SSE41 uint32_t CoverageSSE41(const BlockEdges& edges)
+	{
+		const __m128i dx{ _mm_setr_epi32(0, 1, 2, 3) };
+
+		// Or the edge values together, a pixel is covered when the sign bit is clear
+		__m128i row0{ _mm_setzero_si128() };
+		__m128i row1{ _mm_setzero_si128() };
+		for (int e{}; e < 3; ++e) {
+			const __m128i values{ _mm_add_epi32(_mm_set1_epi32(edges.origin[e]), _mm_mullo_epi32(_mm_set1_epi32(edges.stepX[e]), dx)) };
+			row0 = _mm_or_si128(row0, values);
+			row1 = _mm_or_si128(row1, _mm_add_epi32(values, _mm_set1_epi32(edges.stepY[e])));
+		}
+
+		const uint32_t outside{ uint32_t(_mm_movemask_ps(_mm_castsi128_ps(row0))) | (uint32_t(_mm_movemask_ps(_mm_castsi128_ps(row1))) << 4) };
+		return ~outside & 0xFF;
+	}
+
+	TARGET_AVX2 uint32_t CoverageAVX2(const BlockEdges& edges)
+	{
+		const __m256i dx{ _mm256_setr_epi32(0, 1, 2, 3, 0, 1, 2, 3) };
+		const __m256i dy{ _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1) };
+
+		__m256i combined{ _mm256_setzero_si256() };
+		for (int e{}; e < 3; ++e) {
+			__m256i values{ _mm256_set1_epi32(edges.origin[e]) };
+			values = _mm256_add_epi32(values, _mm256_mullo_epi32(_mm256_set1_epi32(edges.stepX[e]), dx));
+			values = _mm256_add_epi32(values, _mm256_mullo_epi32(_mm256_set1_epi32(edges.stepY[e]), dy));
+			combined = _mm256_or_si256(combined, values);
+		}
+
+		const uint32_t outside{ uint32_t(_mm256_movemask_ps(_mm256_castsi256_ps(combined))) };
+		return ~outside & 0xFF;
+	}
+
+	void CpuId(int leaf, int regs[4])
+	{
+#ifdef _MSC_VER
+		__cpuidex(regs, leaf, 0);
+#else
+		unsigned int a{}, b{}, c{}, d{};
+		__get_cpuid_count(leaf, 0, &a, &b, &c, &d);
+		regs[0] = int(a); regs[1] = int(b); regs[2] = int(c); regs[3] = int(d);
+#endif
+	}
+
+	uint64_t GetEnabledRegisterState()
+	{
+#ifdef _MSC_VER
+		return _xgetbv(0);
+#else
+		uint32_t eax{}, edx{};
+		__asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+		return (uint64_t(edx) << 32) | eax;
+#endif
+	}
+
+	CoverageFunction DetectCoverageFunction()
+	{
+		int regs[4]{};
+		CpuId(0, regs);
+		const int maxLeaf{ regs[0] };
+
+		CpuId(1, regs);
+		const bool hasSSE41{ (regs[2] & (1 << 19)) != 0 };
+		const bool hasOSXSAVE{ (regs[2] & (1 << 27)) != 0 };
+		const bool hasAVX{ (regs[2] & (1 << 28)) != 0 };
+
+		// AVX2 also needs the OS to save the ymm registers
+		bool hasAVX2{ false };
+		if (maxLeaf >= 7 && hasOSXSAVE && hasAVX && (GetEnabledRegisterState() & 0x6) == 0x6) {
+			CpuId(7, regs);
+			hasAVX2 = (regs[1] & (1 << 5)) != 0;
+		}
+
+		if (hasAVX2) return CoverageAVX2;
+		if (hasSSE41) return CoverageSSE41;
+		return CoverageScalar;
+	}
+}
+
+CoverageFunction dae::GetCoverageFunction()
+{
+	static const CoverageFunction coverageFunction{ DetectCoverageFunction() };
+	return coverageFunction;
+}
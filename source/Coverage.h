@@ -0,0 +1,36 @@
+#pragma once
+#include <cstdint>
+
+namespace dae
+{
+	// Pixels are rasterized in blocks of 4x2, bit i of a coverage mask is pixel (i % 4, i / 4) of the block
+	constexpr int BLOCK_WIDTH{ 4 };
+	constexpr int BLOCK_HEIGHT{ 2 };
+	constexpr int BLOCK_PIXELS{ BLOCK_WIDTH * BLOCK_HEIGHT };
+
+	// Blocks are grouped in 8x8 coarse blocks that get trivially rejected or accepted as a whole
+	constexpr int COARSE_BLOCK_SIZE{ 8 };
+
+	// Edge values at the first pixel center of a block and the per pixel steps, for all three edges
+	// The values are saturated to 32 bit, which keeps the sign of every pixel in the block intact
+	struct BlockEdges
+	{
+		int32_t origin[3]{};
+		int32_t stepX[3]{};
+		int32_t stepY[3]{};
+	};
+
+	using CoverageFunction = uint32_t(*)(const BlockEdges& edges);
+
+	// Returns the fastest implementation the cpu supports (AVX2, SSE4.1 or scalar), detected once with cpuid
+	CoverageFunction GetCoverageFunction();
+
+	// Clamps a 64 bit edge value so the steps inside one block can't change its sign
+	inline int32_t SaturateEdge(int64_t value)
+	{
+		constexpr int64_t limit{ int64_t(1) << 30 };
+		if (value > limit) return int32_t(limit);
+		if (value < -limit) return int32_t(-limit);
+		return int32_t(value);
+	}
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include "Math.h"
 #include "vector"
+#include <bit>
 
 namespace dae
 {
@@ -14,29 +15,185 @@ namespace dae
 		Vector3 viewDirection{};
 	};
 
+	// Maximum number of scalar varyings a material can declare on top of the built in attributes
+	constexpr uint32_t MAX_VARYINGS{ 4 };
+
+	// Only what the pixel shading reads, anything else of a vertex, like its color, only gets past the vertex stage in a material's varyings
 	struct Vertex_Out
 	{
 		Vector4 position{};
-		ColorRGB color{ colors::White };
 		Vector2 uv{};
 		Vector3 normal{};
 		Vector3 tangent{};
 		Vector3 viewDirection{};
 	};
 
+	// Vertex_Out with the varyings of its material, for the clipper, triangle setup and the pixel shaders
+	// The vertex stage writes the varyings to a stream of their own, so meshes without any don't carry them around
+	struct VaryingVertex : Vertex_Out
+	{
+		float varyings[MAX_VARYINGS]{};
+	};
+
+	// How much the uv changes from one pixel to the next, taken over the 2x2 quad a pixel gets shaded in
+	struct PixelDerivatives
+	{
+		Vector2 uvDdx{};
+		Vector2 uvDdy{};
+	};
+
+	// Vertex_Out attributes a shading path reads, the vertex stage and triangle setup skip the others
+	constexpr uint32_t ATTRIBUTE_UV{ 1 << 0 };
+	constexpr uint32_t ATTRIBUTE_NORMAL{ 1 << 1 };
+	constexpr uint32_t ATTRIBUTE_TANGENT{ 1 << 2 };
+	constexpr uint32_t ATTRIBUTE_VIEW_DIRECTION{ 1 << 3 };
+
+	// One bit per varying, a material declaring count varyings reads VaryingVertex::varyings[0, count)
+	constexpr uint32_t ATTRIBUTE_VARYING0{ 1 << 4 };
+	constexpr uint32_t ATTRIBUTE_ALL_VARYINGS{ ((1 << MAX_VARYINGS) - 1) * ATTRIBUTE_VARYING0 };
+	constexpr uint32_t AttributeVaryings(uint32_t count) { return ((1 << count) - 1) * ATTRIBUTE_VARYING0; }
+	constexpr uint32_t VaryingCount(uint32_t attributes) { return uint32_t(std::popcount(attributes & ATTRIBUTE_ALL_VARYINGS)); }
+
 	enum class PrimitiveTopology
 	{
 		TriangleList,
 		TriangleStrip
 	};
 
+	// Which side of a triangle gets dropped, front faces are the ones wound clockwise on screen
+	enum class CullMode
+	{
+		None,
+		Back,
+		Front
+	};
+
+	// What a mesh is drawn with, in the order of the renderer's material list
+	enum class MaterialType
+	{
+		Phong,
+		VertexColor
+	};
+
+	// Spatially coherent range of a triangle list with its bounding sphere in object space
+	struct Meshlet
+	{
+		uint32_t firstIndex{};
+		uint32_t indexCount{};
+		Vector3 center{};
+		float radius{};
+	};
+
+	// Structure of arrays copy of a vertex buffer, so the vertex stage can transform 4 vertices per instruction
+	// Every stream is padded with zeroes to a multiple of 4
+	struct VertexStreams
+	{
+		size_t count{};
+		uint32_t version{};
+
+		std::vector<float> positionX{};
+		std::vector<float> positionY{};
+		std::vector<float> positionZ{};
+		std::vector<float> u{};
+		std::vector<float> v{};
+		std::vector<float> normalX{};
+		std::vector<float> normalY{};
+		std::vector<float> normalZ{};
+		std::vector<float> tangentX{};
+		std::vector<float> tangentY{};
+		std::vector<float> tangentZ{};
+	};
+
 	struct Mesh
 	{
 		std::vector<Vertex> vertices{};
 		std::vector<uint32_t> indices{};
 		PrimitiveTopology primitiveTopology{ PrimitiveTopology::TriangleStrip };
+		CullMode cullMode{ CullMode::Back };
+		MaterialType material{ MaterialType::Phong };
+
+		// SoA copy of vertices, the SIMD vertex stage reads it while the lazy one reads vertices itself
+		// Whoever edits vertices bumps vertexVersion, the renderer rebuilds the streams when the versions differ
+		uint32_t vertexVersion{};
+		VertexStreams vertexStreams{};
+
+		// Bounding sphere in object space and the meshlets a triangle list is drawn in, nearest first
+		Vector3 boundsCenter{};
+		float boundsRadius{};
+		std::vector<Meshlet> meshlets{};
 
 		std::vector<Vertex_Out> vertices_out{};
+		// The varyings of vertices_out, as many per vertex as the material declares
+		std::vector<float> varyings_out{};
 		Matrix worldMatrix{};
 	};
+
+	// Screen space positions are snapped to 28.4 fixed point before rasterization
+	constexpr int SUBPIXEL_BITS{ 4 };
+	constexpr int SUBPIXEL_STEP{ 1 << SUBPIXEL_BITS };
+	constexpr int SUBPIXEL_HALF{ SUBPIXEL_STEP / 2 };
+
+	// E(x,y) = a * x + b * y + c in fixed point, >= 0 on the inside of the edge
+	// The top-left fill rule bias is already folded into c
+	struct EdgeFunction
+	{
+		int a{};
+		int b{};
+		int64_t c{};
+	};
+
+	// An attribute that is linear in screen space, x and y are in pixels relative to the plane origin of the triangle
+	struct AttributePlane
+	{
+		float value0{};
+		float dx{};
+		float dy{};
+
+		float Evaluate(float x, float y) const { return value0 + dx * x + dy * y; }
+	};
+
+	// Where the planes of an attribute start in the attribute planes of a triangle
+	// 1/w comes first when any attribute is active, then every component of the active attributes in the order of their bits
+	constexpr uint32_t AttributePlaneOffset(uint32_t attributes, uint32_t attribute)
+	{
+		const uint32_t before{ attributes & (attribute - 1) };
+		return (attributes != 0 ? 1 : 0) +
+			((before & ATTRIBUTE_UV) != 0 ? 2 : 0) +
+			((before & ATTRIBUTE_NORMAL) != 0 ? 3 : 0) +
+			((before & ATTRIBUTE_TANGENT) != 0 ? 3 : 0) +
+			((before & ATTRIBUTE_VIEW_DIRECTION) != 0 ? 3 : 0) +
+			VaryingCount(before);
+	}
+
+	// Attribute planes of a triangle drawn with these attributes, 0 for the depth only and debug states
+	constexpr uint32_t AttributePlaneCount(uint32_t attributes)
+	{
+		return AttributePlaneOffset(attributes, ATTRIBUTE_VARYING0 << MAX_VARYINGS);
+	}
+
+	// Screen space triangle, ready to be rasterized
+	// Only what coverage, the depth test and Hi-Z need, the attribute planes for shading are stored apart
+	struct Triangle
+	{
+		// Inclusive pixel bounds
+		Int2 pMin{};
+		Int2 pMax{};
+
+		// edges[i] is the edge opposite of vertex i, so its value is the unnormalized weight of that vertex
+		EdgeFunction edges[3]{};
+
+		// The snapped first vertex, shifted by half a pixel so integer pixel coordinates land on pixel centers
+		float planeOriginX{};
+		float planeOriginY{};
+
+		// NDC depth is linear in screen space, the attribute planes are divided by w to make them linear
+		AttributePlane depth{};
+		float minDepth{};
+		float maxDepth{};
+
+		// Index into the renderer's material list and of the first of the triangle's attribute planes,
+		// it has AttributePlaneCount() of them for what its material reads
+		uint32_t material{};
+		uint32_t firstPlane{};
+	};
 }
\ No newline at end of file
@@ -0,0 +1,52 @@
+#pragma once
+#include <cfloat>
+#include <cstdint>
+#include <algorithm>
+
+namespace dae
+{
+	// Depth buffer formats, each one maps NDC depth in [0, 1] to the value stored per pixel
+	// The renderer is built for exactly one of them through DepthFormat below, so the depth test never branches on the format
+	struct DepthFormatFloat32
+	{
+		using Type = float;
+		static constexpr Type ClearValue{ FLT_MAX };
+		static constexpr float Quantum{ FLT_EPSILON }; // Largest step between two representable depths in [0, 1]
+
+		static constexpr Type Encode(float depth) { return depth; }
+		static constexpr float Decode(Type value) { return value; }
+		static constexpr bool IsCloser(Type a, Type b) { return a < b; }
+	};
+
+	// Unsigned normalized, the near plane maps to 0 and the buffer clears to the far plane
+	// The steps are evenly spaced, so unlike a float buffer there is no precision to win by reversing the mapping
+	template<typename StorageType, int Bits>
+	struct DepthFormatUnorm
+	{
+		using Type = StorageType;
+		static constexpr float MaxValue{ float((uint32_t(1) << Bits) - 1) };
+		static constexpr Type ClearValue{ Type((uint32_t(1) << Bits) - 1) };
+		static constexpr float Quantum{ 1.f / MaxValue };
+
+		// Rounded in double, 16777215.5f is not representable and would round up to 1 << 24, past the clear value
+		static constexpr Type Encode(float depth) { return Type(double(std::clamp(depth, 0.f, 1.f)) * MaxValue + 0.5); }
+		static constexpr float Decode(Type value) { return float(value) / MaxValue; }
+		static constexpr bool IsCloser(Type a, Type b) { return a < b; }
+	};
+
+	// 24 bits in the low part of a 32 bit word, leaving the top 8 bits free for a stencil value
+	using DepthFormatUnorm24 = DepthFormatUnorm<uint32_t, 24>;
+
+	// Half the memory, but only 65536 steps, which is coarse for the far end of a perspective projection
+	using DepthFormatUnorm16 = DepthFormatUnorm<uint16_t, 16>;
+
+	// The far plane, and everything clamped to it, has to land exactly on the clear value and never spill into the bits above it
+	static_assert(DepthFormatUnorm24::Encode(1.f) == DepthFormatUnorm24::ClearValue && DepthFormatUnorm24::Encode(2.f) == DepthFormatUnorm24::ClearValue);
+	static_assert(DepthFormatUnorm16::Encode(1.f) == DepthFormatUnorm16::ClearValue && DepthFormatUnorm16::Encode(2.f) == DepthFormatUnorm16::ClearValue);
+	// The float format clears past the far plane instead, the W1 stages store view space depth in it
+	static_assert(DepthFormatFloat32::IsCloser(DepthFormatFloat32::Encode(1.f), DepthFormatFloat32::ClearValue));
+
+	// The format the renderer is compiled with
+	// The W1 stages store view space depth instead of NDC depth, they only work with DepthFormatFloat32
+	using DepthFormat = DepthFormatFloat32;
+}
@@ -0,0 +1,79 @@
+#include "LinearAllocator.h"
+
+//Standard includes
+#include <algorithm>
+#include <cassert>
+
+using namespace dae;
+
+LinearAllocator::LinearAllocator(size_t capacity) :
+	m_pBuffer{ new uint8_t[capacity] },
+	m_Capacity{ capacity }
+{
+}
+
+LinearAllocator::~LinearAllocator()
+{
+	for (uint8_t* pBlock : m_pOverflowBlocks) {
+		delete[] pBlock;
+	}
+	delete[] m_pBuffer;
+}
+
+void* LinearAllocator::Allocate(size_t size, size_t alignment)
+{
+	const uintptr_t base{ reinterpret_cast<uintptr_t>(m_pBuffer) };
+	const uintptr_t aligned{ (base + m_Offset + alignment - 1) & ~(uintptr_t(alignment) - 1) };
+	const size_t newOffset{ size_t(aligned - base) + size };
+
+	if (newOffset <= m_Capacity) {
+		m_Offset = newOffset;
+		m_HighWaterMark = std::max(m_HighWaterMark, GetUsed());
+		return reinterpret_cast<void*>(aligned);
+	}
+
+	// Out of space, take it from the heap for this frame (new[] is aligned for any fundamental type)
+	uint8_t* pBlock{ new uint8_t[size + alignment] };
+	m_pOverflowBlocks.push_back(pBlock);
+	m_OverflowSize += size + alignment;
+	m_HighWaterMark = std::max(m_HighWaterMark, GetUsed());
+
+	const uintptr_t blockBase{ reinterpret_cast<uintptr_t>(pBlock) };
+	return reinterpret_cast<void*>((blockBase + alignment - 1) & ~(uintptr_t(alignment) - 1));
+}
+
+void LinearAllocator::Reset()
+{
+	if (!m_pOverflowBlocks.empty()) {
+		for (uint8_t* pBlock : m_pOverflowBlocks) {
+			delete[] pBlock;
+		}
+		m_pOverflowBlocks.clear();
+		m_OverflowSize = 0;
+
+		// Grow so the next frame fits in one buffer
+		delete[] m_pBuffer;
+		m_Capacity = m_HighWaterMark + m_HighWaterMark / 4;
+		m_pBuffer = new uint8_t[m_Capacity];
+	}
+
+	m_Offset = 0;
+}
+
+void LinearAllocator::Rewind(size_t marker)
+{
+	assert(marker <= m_Offset && "Rewinding past the current offset");
+	m_Offset = marker;
+}
+
+void LinearAllocator::Reserve(size_t size)
+{
+	assert(m_Offset == 0 && m_pOverflowBlocks.empty() && "Reserve moves the buffer, so only right after a Reset");
+	if (size <= m_Capacity) {
+		return;
+	}
+
+	delete[] m_pBuffer;
+	m_Capacity = size;
+	m_pBuffer = new uint8_t[m_Capacity];
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+//Standard includes
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+namespace dae
+{
+	// Bump allocator for data that only lives for one frame, everything is released at once with Reset
+	// When a frame needs more than the capacity, the extra memory comes from the heap and the buffer
+	// grows to the high-water mark on the next Reset, so a steady scene stops allocating after one frame
+	class LinearAllocator final
+	{
+	public:
+		explicit LinearAllocator(size_t capacity);
+		~LinearAllocator();
+
+		LinearAllocator(const LinearAllocator&) = delete;
+		LinearAllocator(LinearAllocator&&) noexcept = delete;
+		LinearAllocator& operator=(const LinearAllocator&) = delete;
+		LinearAllocator& operator=(LinearAllocator&&) noexcept = delete;
+
+		void* Allocate(size_t size, size_t alignment);
+
+		// Memory is not initialized and destructors never run, so only trivially destructible types
+		template<typename T>
+		T* Allocate(size_t count)
+		{
+			static_assert(std::is_trivially_destructible_v<T>, "LinearAllocator never runs destructors");
+			return static_cast<T*>(Allocate(count * sizeof(T), alignof(T)));
+		}
+
+		void Reset();
+
+		// Everything allocated after the marker is released by rewinding to it, heap fallbacks stay until Reset
+		size_t GetMarker() const { return m_Offset; };
+		void Rewind(size_t marker);
+
+		// Grows the buffer to at least size bytes, only right after a Reset because it moves the buffer
+		void Reserve(size_t size);
+
+		size_t GetCapacity() const { return m_Capacity; };
+		size_t GetUsed() const { return m_Offset + m_OverflowSize; };
+		size_t GetHighWaterMark() const { return m_HighWaterMark; };
+
+		// Allocations since the last Reset that didn't fit and came from the heap
+		size_t GetOverflowCount() const { return m_pOverflowBlocks.size(); };
+
+	private:
+		uint8_t* m_pBuffer{ nullptr };
+		size_t m_Capacity{};
+		size_t m_Offset{};
+
+		std::vector<uint8_t*> m_pOverflowBlocks{};
+		size_t m_OverflowSize{};
+
+		size_t m_HighWaterMark{};
+	};
+}
@@ -2,11 +2,20 @@
 #include "SDL.h"
 #include "SDL_surface.h"
 
+//Standard includes
+#include <algorithm>
+#include <cassert>
+#include <bit>
+#include <numeric>
+#include <immintrin.h>
+
 //Project includes
 #include "Renderer.h"
 #include "Math.h"
 #include "Matrix.h"
 #include "Texture.h"
+#include "ThreadPool.h"
+#include "LinearAllocator.h"
 #include "Utils.h"
 
 using namespace dae;
@@ -21,8 +30,33 @@ Renderer::Renderer(SDL_Window* pWindow) :
 	m_pFrontBuffer = SDL_GetWindowSurface(pWindow);
 	m_pBackBuffer = SDL_CreateRGBSurface(0, m_Width, m_Height, 32, 0, 0, 0, 0);
 	m_pBackBufferPixels = (uint32_t*)m_pBackBuffer->pixels;
-
-	m_pDepthBufferPixels = new float[m_Width * m_Height];
+	m_ClearColor = SDL_MapRGB(m_pBackBuffer->format, 128, 128, 128);
+
+	m_pDepthBufferPixels = new DepthFormat::Type[m_Width * m_Height];
+	m_pVisibilityBufferPixels = new uint32_t[m_Width * m_Height];
+
+	// One Hi-Z entry per coarse block
+	m_HiZWidth = (m_Width + COARSE_BLOCK_SIZE - 1) / COARSE_BLOCK_SIZE;
+	m_HiZHeight = (m_Height + COARSE_BLOCK_SIZE - 1) / COARSE_BLOCK_SIZE;
+	m_pHiZMinDepth = new float[m_HiZWidth * m_HiZHeight];
+	m_pHiZMaxDepth = new float[m_HiZWidth * m_HiZHeight];
+
+	// Screen tiles + worker threads for the rasterizer
+	m_TileCountX = (m_Width + m_TileSize - 1) / m_TileSize;
+	m_TileCountY = (m_Height + m_TileSize - 1) / m_TileSize;
+	m_pTileCleared = new bool[m_TileCountX * m_TileCountY];
+	m_pThreadPool = new ThreadPool();
+
+	// Guard band as a multiple of w, so screen coordinates stay within m_GuardBandSize pixels of the screen
+	m_GuardBandX = 1.f + 2.f * m_GuardBandSize / m_Width;
+	m_GuardBandY = 1.f + 2.f * m_GuardBandSize / m_Height;
+
+	// Arenas for transient data, they grow by themselves if a frame ever needs more
+	m_pFrameArena = new LinearAllocator(8 * 1024 * 1024);
+	for (uint32_t i{ 0 }; i < m_pThreadPool->GetThreadCount(); ++i) {
+		m_pWorkerArenas.push_back(new LinearAllocator(256 * 1024));
+	}
+	m_CoverageFunction = GetCoverageFunction();
 
 	//Initialize Camera
 	m_Camera.Initialize(45.f, { 0.0f,0.0f,0.0f }, float(m_Width)/ m_Height);
@@ -31,17 +65,39 @@ Renderer::Renderer(SDL_Window* pWindow) :
 	m_pObjectMesh = new Mesh();
 	Utils::ParseOBJ("Resources/vehicle.obj", m_pObjectMesh->vertices, m_pObjectMesh->indices);
 	m_pObjectMesh->primitiveTopology = PrimitiveTopology::TriangleList;
+	Utils::BuildMeshlets(m_pObjectMesh->vertices, m_pObjectMesh->indices, m_pObjectMesh->meshlets);
+	Utils::OptimizeVertexFetch(m_pObjectMesh->vertices, m_pObjectMesh->indices);
+	Utils::ComputeBoundingSphere(m_pObjectMesh->vertices, m_pObjectMesh->indices.data(), m_pObjectMesh->indices.size(),
+		m_pObjectMesh->boundsCenter, m_pObjectMesh->boundsRadius);
+	Utils::BuildVertexStreams(*m_pObjectMesh);
+	m_pMeshes.push_back(m_pObjectMesh);
 
 	// Initialize Textures
-	m_pDiffuseColor = Texture::LoadFromFile("Resources/vehicle_diffuse.png");
-	m_pNormalMap = Texture::LoadFromFile("Resources/vehicle_normal.png");
-	m_pSpecularMap = Texture::LoadFromFile("Resources/vehicle_specular.png");
-	m_pGlossyMap = Texture::LoadFromFile("Resources/vehicle_gloss.png");
+	m_pDiffuseColor = Texture::LoadFromFile("Resources/vehicle_diffuse.png", m_pThreadPool);
+	m_pNormalMap = Texture::LoadFromFile("Resources/vehicle_normal.png", m_pThreadPool);
+	m_pSpecularMap = Texture::LoadFromFile("Resources/vehicle_specular.png", m_pThreadPool);
+	m_pGlossyMap = Texture::LoadFromFile("Resources/vehicle_gloss.png", m_pThreadPool);
+
+	PhongConstants& phong{ std::get<PhongConstants>(m_ShaderConstants) };
+	phong.pDiffuseMap = m_pDiffuseColor;
+	phong.pNormalMap = m_pNormalMap;
+	phong.pSpecularMap = m_pSpecularMap;
+	phong.pGlossyMap = m_pGlossyMap;
 }
 
 Renderer::~Renderer()
 {
 	delete[] m_pDepthBufferPixels;
+	delete[] m_pVisibilityBufferPixels;
+	delete[] m_pHiZMinDepth;
+	delete[] m_pHiZMaxDepth;
+	delete[] m_pTileCleared;
+	delete m_pThreadPool;
+
+	delete m_pFrameArena;
+	for (LinearAllocator* pArena : m_pWorkerArenas) {
+		delete pArena;
+	}
 
 	delete m_pDiffuseColor;
 	delete m_pNormalMap;
@@ -70,11 +126,18 @@ void Renderer::Render()
 	//Lock BackBuffer
 	SDL_LockSurface(m_pBackBuffer);
 	
-	// Clear buffers
-	SDL_FillRect(m_pBackBuffer, NULL, SDL_MapRGB(m_pBackBuffer->format, 128, 128, 128));
-	std::fill_n(m_pDepthBufferPixels, m_Width*m_Height, FLT_MAX);
+	// Release last frame's transient data
+	m_pFrameArena->Reset();
+	for (LinearAllocator* pArena : m_pWorkerArenas) {
+		pArena->Reset();
+	}
+
+	// Clear buffers, a tile is only really cleared once a triangle touches it
+	std::fill_n(m_pTileCleared, m_TileCountX * m_TileCountY, false);
 
 	//RENDER LOGIC
+	//The W stages draw without tiles, they need ClearBuffers() first
+	//ClearBuffers();
 	//W1_Rasterization();
 	//W1_Perspective();
 	//W1_BaryCentricCoords();
@@ -87,6 +150,19 @@ void Renderer::Render()
 
 	RenderMeshes();
 
+	// Tiles that no triangle touched only need the clear color
+	ResolveUntouchedTiles();
+
+	// Steady state, the arenas grew to this scene during the warm-up so the heap is off limits now
+#ifndef NDEBUG
+	if (m_FramesSinceArenaWarmUp < m_ArenaWarmUpFrames) {
+		++m_FramesSinceArenaWarmUp;
+	}
+	else {
+		assert(GetArenaOverflowCount() == 0 && "An arena fell back to the heap after the warm-up");
+	}
+#endif
+
 	//@END
 	//Update SDL Surface
 	SDL_UnlockSurface(m_pBackBuffer);
@@ -94,6 +170,52 @@ void Renderer::Render()
 	SDL_UpdateWindowSurface(m_pWindow);
 }
 
+void Renderer::ClearBuffers()
+{
+	SDL_FillRect(m_pBackBuffer, NULL, m_ClearColor);
+	std::fill_n(m_pDepthBufferPixels, m_Width * m_Height, DepthFormat::ClearValue);
+	std::fill_n(m_pHiZMinDepth, m_HiZWidth * m_HiZHeight, m_HiZClearDepth);
+	std::fill_n(m_pHiZMaxDepth, m_HiZWidth * m_HiZHeight, m_HiZClearDepth);
+	std::fill_n(m_pTileCleared, m_TileCountX * m_TileCountY, true);
+}
+
+void Renderer::ClearTile(int tileIndex, const Int2& tileMin, const Int2& tileMax) const
+{
+	if (m_pTileCleared[tileIndex]) {
+		return;
+	}
+	m_pTileCleared[tileIndex] = true;
+
+	const int tileWidth{ tileMax.x - tileMin.x + 1 };
+	for (int py{ tileMin.y }; py <= tileMax.y; ++py) {
+		std::fill_n(m_pBackBufferPixels + tileMin.x + (py * m_Width), tileWidth, m_ClearColor);
+		std::fill_n(m_pDepthBufferPixels + tileMin.x + (py * m_Width), tileWidth, DepthFormat::ClearValue);
+	}
+
+	// Tiles are a multiple of the coarse block size, so these Hi-Z entries belong to this tile alone
+	for (int by{ tileMin.y / COARSE_BLOCK_SIZE }; by <= tileMax.y / COARSE_BLOCK_SIZE; ++by) {
+		const int rowStart{ tileMin.x / COARSE_BLOCK_SIZE + (by * m_HiZWidth) };
+		const int blockCount{ tileMax.x / COARSE_BLOCK_SIZE - tileMin.x / COARSE_BLOCK_SIZE + 1 };
+		std::fill_n(m_pHiZMinDepth + rowStart, blockCount, m_HiZClearDepth);
+		std::fill_n(m_pHiZMaxDepth + rowStart, blockCount, m_HiZClearDepth);
+	}
+}
+
+void Renderer::ResolveUntouchedTiles() const
+{
+	for (int tileIndex{ 0 }; tileIndex < m_TileCountX * m_TileCountY; ++tileIndex) {
+		if (m_pTileCleared[tileIndex]) {
+			continue;
+		}
+
+		const Int2 tileMin{ (tileIndex % m_TileCountX) * m_TileSize, (tileIndex / m_TileCountX) * m_TileSize };
+		const Int2 tileMax{ std::min(tileMin.x + m_TileSize, m_Width) - 1, std::min(tileMin.y + m_TileSize, m_Height) - 1 };
+		for (int py{ tileMin.y }; py <= tileMax.y; ++py) {
+			std::fill_n(m_pBackBufferPixels + tileMin.x + (py * m_Width), tileMax.x - tileMin.x + 1, m_ClearColor);
+		}
+	}
+}
+
 void Renderer::VertexTransformationFunction(const std::vector<Vertex>& vertices_in, std::vector<Vertex>& vertices_out) const
 {
 	vertices_out.reserve(vertices_in.size());
@@ -122,40 +244,92 @@ void Renderer::VertexTransformationFunction(const std::vector<Vertex>& vertices_
 
 void Renderer::VertexTransformationFunction(Mesh& mesh) const
 {
-	mesh.vertices_out.reserve(mesh.vertices.size());
+	// The count check only catches a resize someone forgot to version, an in place edit needs the version bump
+	if (mesh.vertexStreams.version != mesh.vertexVersion || mesh.vertexStreams.count != mesh.vertices.size()) {
+		Utils::BuildVertexStreams(mesh);
+	}
 
-	Matrix WVPMatrix{ mesh.worldMatrix * m_Camera.viewMatrix * m_Camera.projectionMatrix };
+	// The output buffers live with the mesh, so they are only reallocated when the vertex count changes
+	mesh.vertices_out.resize(mesh.vertices.size());
+	mesh.varyings_out.resize(mesh.vertices.size() * VaryingCount(Materials::attributes[size_t(mesh.material)]));
 
-	for (const Vertex& vertex : mesh.vertices) {
+	const VertexShaderContext context{ GetVertexShaderContext(mesh) };
 
-		// Init out vertex
-		Vertex_Out vertexOut{};
-		vertexOut.position = { vertex.position.x, vertex.position.y, vertex.position.z, 1 };
-		vertexOut.color = vertex.color;
-		vertexOut.uv = vertex.uv;
-		vertexOut.normal = vertex.normal;
-		vertexOut.tangent = vertex.tangent;
+	// Large meshes are split into chunks that the workers transform straight into vertices_out
+	// Chunks are a multiple of the SIMD batch size, so no two workers ever write the same batch
+	const size_t vertexCount{ mesh.vertices.size() };
+	const uint32_t chunkCount{ uint32_t((vertexCount + m_VertexChunkSize - 1) / m_VertexChunkSize) };
 
-		// World to NDC space
-		vertexOut.position = WVPMatrix.TransformPoint(vertexOut.position);
+	Materials::Dispatch(uint32_t(mesh.material), [&]<typename Shader>() {
+		m_pThreadPool->ParallelFor(chunkCount, [&](uint32_t chunkIndex, uint32_t) {
+			const size_t begin{ size_t(chunkIndex) * m_VertexChunkSize };
+			TransformVertexRange<typename Shader::VertexShader>(mesh, context, begin, std::min(begin + m_VertexChunkSize, vertexCount));
+		});
+	});
+}
 
-		// Perspective divide
-		vertexOut.position.x /= vertexOut.position.w;
-		vertexOut.position.y /= vertexOut.position.w;
-		vertexOut.position.z /= vertexOut.position.w;
+VertexShaderContext Renderer::GetVertexShaderContext(const Mesh& mesh) const
+{
+	return VertexShaderContext{ mesh.worldMatrix * m_Camera.viewMatrix * m_Camera.projectionMatrix, mesh.worldMatrix,
+		m_Camera.origin, m_MaterialAttributes[size_t(mesh.material)] };
+}
 
-		// Transform normal and tangent To World space
-		vertexOut.normal = mesh.worldMatrix.TransformVector(vertexOut.normal);
-		vertexOut.tangent = mesh.worldMatrix.TransformVector(vertexOut.tangent);
+void Renderer::PerspectiveDivide(Mesh& mesh) const
+{
+	for (Vertex_Out& vertex : mesh.vertices_out) {
+		vertex.position.x /= vertex.position.w;
+		vertex.position.y /= vertex.position.w;
+		vertex.position.z /= vertex.position.w;
+	}
+}
 
-		// Calculate viewDirection
-		vertexOut.viewDirection = mesh.worldMatrix.TransformPoint(vertex.position) - m_Camera.origin;
-		vertexOut.viewDirection.Normalize();
+template<VertexShader Shader>
+void Renderer::TransformVertexRange(Mesh& mesh, const VertexShaderContext& context, size_t begin, size_t end) const
+{
+	// Shaders with a SIMD version read the vertex streams, the others go one vertex at a time
+	if constexpr (requires { Shader::TransformRange(context, mesh.vertexStreams, begin, end, mesh.vertices_out.data()); }) {
+		Shader::TransformRange(context, mesh.vertexStreams, begin, end, mesh.vertices_out.data());
+	}
+	else {
+		for (size_t vertexIndex{ begin }; vertexIndex < end; ++vertexIndex) {
+			const Vertex& vertex{ mesh.vertices[vertexIndex] };
+			Vertex_Out& vertexOut{ mesh.vertices_out[vertexIndex] };
+			vertexOut.position = Shader::TransformPosition(context, vertex);
+			Shader::TransformAttributes(context, vertex, vertexOut);
+		}
+	}
 
-		mesh.vertices_out.emplace_back(vertexOut);
+	// Varyings only for materials that declare them, and only when this frame's shading reads them
+	if constexpr (requires { Shader::TransformVaryings(context, mesh.vertices[begin], mesh.varyings_out.data()); }) {
+		if (context.attributes & ATTRIBUTE_ALL_VARYINGS) {
+			const uint32_t varyingCount{ VaryingCount(Materials::attributes[size_t(mesh.material)]) };
+			for (size_t vertexIndex{ begin }; vertexIndex < end; ++vertexIndex) {
+				Shader::TransformVaryings(context, mesh.vertices[vertexIndex], mesh.varyings_out.data() + vertexIndex * varyingCount);
+			}
+		}
 	}
 }
 
+void Renderer::TransformVertexPosition(Mesh& mesh, const VertexShaderContext& context, uint32_t vertexIndex) const
+{
+	Materials::Dispatch(uint32_t(mesh.material), [&]<typename Shader>() {
+		mesh.vertices_out[vertexIndex].position = Shader::VertexShader::TransformPosition(context, mesh.vertices[vertexIndex]);
+	});
+}
+
+void Renderer::TransformVertexAttributes(Mesh& mesh, const VertexShaderContext& context, uint32_t vertexIndex) const
+{
+	Materials::Dispatch(uint32_t(mesh.material), [&]<typename Shader>() {
+		Shader::VertexShader::TransformAttributes(context, mesh.vertices[vertexIndex], mesh.vertices_out[vertexIndex]);
+		if constexpr (requires { Shader::VertexShader::TransformVaryings(context, mesh.vertices[vertexIndex], mesh.varyings_out.data()); }) {
+			if (context.attributes & ATTRIBUTE_ALL_VARYINGS) {
+				constexpr uint32_t varyingCount{ VaryingCount(Shader::attributes) };
+				Shader::VertexShader::TransformVaryings(context, mesh.vertices[vertexIndex], mesh.varyings_out.data() + size_t(vertexIndex) * varyingCount);
+			}
+		}
+	});
+}
+
 void Renderer::ToggleMode() {
 	m_RenderMode = RenderMode((int(m_RenderMode) + 1) % 4);
 }
@@ -176,7 +350,27 @@ void Renderer::ToggleNormalMap() {
 	m_UseNormalMap = !m_UseNormalMap;
 }
 
-float Renderer::Remap(float value, float min, float max) {
+void Renderer::ToggleLazyVertexShading() {
+	m_LazyVertexShading = !m_LazyVertexShading;
+}
+
+void Renderer::ToggleVisibilityBuffer() {
+	m_UseVisibilityBuffer = !m_UseVisibilityBuffer;
+}
+
+void Renderer::ToggleDepthPrePass() {
+	m_UseDepthPrePass = !m_UseDepthPrePass;
+}
+
+void Renderer::ToggleFrontToBackSorting() {
+	m_SortFrontToBack = !m_SortFrontToBack;
+}
+
+void Renderer::ToggleVertexColorMaterial() {
+	m_pObjectMesh->material = m_pObjectMesh->material == MaterialType::Phong ? MaterialType::VertexColor : MaterialType::Phong;
+}
+
+float Renderer::Remap(float value, float min, float max) const {
 	return (value - min) / (max - min);
 }
 
@@ -185,6 +379,34 @@ bool Renderer::SaveBufferToImage() const
 	return SDL_SaveBMP(m_pBackBuffer, "Rasterizer_ColorBuffer.bmp");
 }
 
+float Renderer::GetDepthTestFailRate() const
+{
+	return m_DepthTestStats.testCount == 0 ? 0.f : float(m_DepthTestStats.failCount) / m_DepthTestStats.testCount;
+}
+
+size_t Renderer::GetFrameArenaHighWaterMark() const
+{
+	return m_pFrameArena->GetHighWaterMark();
+}
+
+size_t Renderer::GetArenaOverflowCount() const
+{
+	size_t overflowCount{ m_pFrameArena->GetOverflowCount() };
+	for (const LinearAllocator* pArena : m_pWorkerArenas) {
+		overflowCount += pArena->GetOverflowCount();
+	}
+	return overflowCount;
+}
+
+size_t Renderer::GetWorkerArenaHighWaterMark() const
+{
+	size_t highWaterMark{};
+	for (const LinearAllocator* pArena : m_pWorkerArenas) {
+		highWaterMark = std::max(highWaterMark, pArena->GetHighWaterMark());
+	}
+	return highWaterMark;
+}
+
 void Renderer::W1_Rasterization() {
 	//Triangel in NDC Space
 	std::vector<Vector3> vertices_ndc{
@@ -208,8 +430,8 @@ void Renderer::W1_Rasterization() {
 
 
 		// Loop over pixels
-		for (int px{}; px < m_Width; ++px) {
-			for (int py{}; py < m_Height; ++py) {
+		for (int py{}; py < m_Height; ++py) {
+			for (int px{}; px < m_Width; ++px) {
 
 				Vector2 pixel{ float(px),float(py) };
 
@@ -264,8 +486,8 @@ void Renderer::W1_Perspective() {
 		Vector2 v2{ vertices_screen[triangleIndex * 3 + 2].position.GetXY() };
 
 		// Loop over pixels
-		for (int px{}; px < m_Width; ++px) {
-			for (int py{}; py < m_Height; ++py) {
+		for (int py{}; py < m_Height; ++py) {
+			for (int px{}; px < m_Width; ++px) {
 
 				Vector2 pixel{ float(px),float(py) };
 
@@ -319,8 +541,8 @@ void Renderer::W1_BaryCentricCoords() {
 		Vertex v2{ vertices_screen[triangleIndex * 3 + 2] };
 
 		// Loop over pixels
-		for (int px{}; px < m_Width; ++px) {
-			for (int py{}; py < m_Height; ++py) {
+		for (int py{}; py < m_Height; ++py) {
+			for (int px{}; px < m_Width; ++px) {
 
 				Vector2 pixel{ float(px),float(py) };
 
@@ -388,8 +610,8 @@ void Renderer::W1_DepthBuffer() {
 		Vertex v2{ vertices_screen[triangleIndex * 3 + 2] };
 
 		// Loop over pixels
-		for (int px{}; px < m_Width; ++px) {
-			for (int py{}; py < m_Height; ++py) {
+		for (int py{}; py < m_Height; ++py) {
+			for (int px{}; px < m_Width; ++px) {
 
 				Vector2 pixel{ float(px),float(py) };
 
@@ -417,12 +639,12 @@ void Renderer::W1_DepthBuffer() {
 					w2 /= totalArea;
 
 					float interpolatedDepth{ w0 * v0.position.z + w1 * v1.position.z + w2 * v2.position.z };
-					bool depthTestPassed{ interpolatedDepth < m_pDepthBufferPixels[px + (py * m_Width)] };
+					bool depthTestPassed{ DepthFormat::IsCloser(DepthFormat::Encode(interpolatedDepth), m_pDepthBufferPixels[px + (py * m_Width)]) };
 
 					if (depthTestPassed) {
 
 						// Update Depth Buffer
-						m_pDepthBufferPixels[px + (py * m_Width)] = interpolatedDepth;
+						m_pDepthBufferPixels[px + (py * m_Width)] = DepthFormat::Encode(interpolatedDepth);
 
 						// Interpolated color
 						ColorRGB finalColor{ w0 * v0.color + w1 * v1.color + w2 * v2.color };
@@ -468,14 +690,14 @@ void Renderer::W1_BoundingBox() {
 
 		// Find bounding box
 		Int2 pMin{}, pMax{};
-		pMin.x = Clamp(int(std::min(v2.position.x, std::min(v0.position.x, v1.position.x))), 0, m_Width);
-		pMin.y = Clamp(int(std::min(v2.position.y, std::min(v0.position.y, v1.position.y))), 0, m_Height);
-		pMax.x = Clamp(int(std::max(v2.position.x, std::max(v0.position.x, v1.position.x))), 0, m_Width);
-		pMax.y = Clamp(int(std::max(v2.position.y, std::max(v0.position.y, v1.position.y))), 0, m_Height);
+		pMin.x = Clamp(int(std::min(v2.position.x, std::min(v0.position.x, v1.position.x))), 0, m_Width - 1);
+		pMin.y = Clamp(int(std::min(v2.position.y, std::min(v0.position.y, v1.position.y))), 0, m_Height - 1);
+		pMax.x = Clamp(int(std::max(v2.position.x, std::max(v0.position.x, v1.position.x))), 0, m_Width - 1);
+		pMax.y = Clamp(int(std::max(v2.position.y, std::max(v0.position.y, v1.position.y))), 0, m_Height - 1);
 
 		// Loop over pixels
-		for (int px{pMin.x}; px <= pMax.x; ++px) {
-			for (int py{pMin.y}; py <= pMax.y; ++py) {
+		for (int py{ pMin.y }; py <= pMax.y; ++py) {
+			for (int px{ pMin.x }; px <= pMax.x; ++px) {
 
 				Vector2 pixel{ float(px),float(py) };
 
@@ -503,12 +725,12 @@ void Renderer::W1_BoundingBox() {
 					w2 /= totalArea;
 
 					float interpolatedDepth{ w0 * v0.position.z + w1 * v1.position.z + w2 * v2.position.z };
-					bool depthTestPassed{ interpolatedDepth < m_pDepthBufferPixels[px + (py * m_Width)] };
+					bool depthTestPassed{ DepthFormat::IsCloser(DepthFormat::Encode(interpolatedDepth), m_pDepthBufferPixels[px + (py * m_Width)]) };
 
 					if (depthTestPassed) {
 
 						// Update Depth Buffer
-						m_pDepthBufferPixels[px + (py * m_Width)] = interpolatedDepth;
+						m_pDepthBufferPixels[px + (py * m_Width)] = DepthFormat::Encode(interpolatedDepth);
 
 						// Interpolated color
 						ColorRGB finalColor{ w0 * v0.color + w1 * v1.color + w2 * v2.color };
@@ -551,9 +773,10 @@ void Renderer::W2_TriangleList() {
 		}
 	};
 
-	for (Mesh mesh : meshes_world) {
+	for (Mesh& mesh : meshes_world) {
 
 		VertexTransformationFunction(mesh);
+		PerspectiveDivide(mesh);
 
 		// Loop over triangles
 		for (int triangleIndex{ 0 }; triangleIndex + 2 < mesh.indices.size(); ++triangleIndex) {
@@ -592,14 +815,14 @@ void Renderer::W2_TriangleList() {
 
 			// Find bounding box
 			Int2 pMin{}, pMax{};
-			pMin.x = Clamp(int(std::min(v2.position.x, std::min(v0.position.x, v1.position.x))), 0, m_Width);
-			pMin.y = Clamp(int(std::min(v2.position.y, std::min(v0.position.y, v1.position.y))), 0, m_Height);
-			pMax.x = Clamp(int(std::max(v2.position.x, std::max(v0.position.x, v1.position.x))), 0, m_Width);
-			pMax.y = Clamp(int(std::max(v2.position.y, std::max(v0.position.y, v1.position.y))), 0, m_Height);
+			pMin.x = Clamp(int(std::min(v2.position.x, std::min(v0.position.x, v1.position.x))), 0, m_Width - 1);
+			pMin.y = Clamp(int(std::min(v2.position.y, std::min(v0.position.y, v1.position.y))), 0, m_Height - 1);
+			pMax.x = Clamp(int(std::max(v2.position.x, std::max(v0.position.x, v1.position.x))), 0, m_Width - 1);
+			pMax.y = Clamp(int(std::max(v2.position.y, std::max(v0.position.y, v1.position.y))), 0, m_Height - 1);
 
 			// Loop over pixels
-			for (int px{ pMin.x }; px <= pMax.x; ++px) {
-				for (int py{ pMin.y }; py <= pMax.y; ++py) {
+			for (int py{ pMin.y }; py <= pMax.y; ++py) {
+				for (int px{ pMin.x }; px <= pMax.x; ++px) {
 
 					Vector2 pixel{ float(px),float(py) };
 
@@ -627,15 +850,15 @@ void Renderer::W2_TriangleList() {
 						w2 /= totalArea;
 
 						float interpolatedDepth{ w0 * v0.position.z + w1 * v1.position.z + w2 * v2.position.z };
-						bool depthTestPassed{ interpolatedDepth < m_pDepthBufferPixels[px + (py * m_Width)] };
+						bool depthTestPassed{ DepthFormat::IsCloser(DepthFormat::Encode(interpolatedDepth), m_pDepthBufferPixels[px + (py * m_Width)]) };
 
 						if (depthTestPassed) {
 
 							// Update Depth Buffer
-							m_pDepthBufferPixels[px + (py * m_Width)] = interpolatedDepth;
+							m_pDepthBufferPixels[px + (py * m_Width)] = DepthFormat::Encode(interpolatedDepth);
 
 							// Interpolated color
-							ColorRGB finalColor{ w0 * v0.color + w1 * v1.color + w2 * v2.color };
+							ColorRGB finalColor{ w0 * mesh.vertices[index0].color + w1 * mesh.vertices[index1].color + w2 * mesh.vertices[index2].color };
 
 							//Update Color in Buffer
 							finalColor.MaxToOne();
@@ -676,9 +899,10 @@ void Renderer::W2_TriangleStrip() {
 		}
 	};
 
-	for (Mesh mesh : meshes_world) {
+	for (Mesh& mesh : meshes_world) {
 
 		VertexTransformationFunction(mesh);
+		PerspectiveDivide(mesh);
 
 		// Loop over triangles
 		for (int triangleIndex{ 0 }; triangleIndex + 2 < mesh.indices.size(); ++triangleIndex) {
@@ -717,14 +941,14 @@ void Renderer::W2_TriangleStrip() {
 
 			// Find bounding box
 			Int2 pMin{}, pMax{};
-			pMin.x = Clamp(int(std::min(v2.position.x, std::min(v0.position.x, v1.position.x))), 0, m_Width);
-			pMin.y = Clamp(int(std::min(v2.position.y, std::min(v0.position.y, v1.position.y))), 0, m_Height);
-			pMax.x = Clamp(int(std::max(v2.position.x, std::max(v0.position.x, v1.position.x))), 0, m_Width);
-			pMax.y = Clamp(int(std::max(v2.position.y, std::max(v0.position.y, v1.position.y))), 0, m_Height);
+			pMin.x = Clamp(int(std::min(v2.position.x, std::min(v0.position.x, v1.position.x))), 0, m_Width - 1);
+			pMin.y = Clamp(int(std::min(v2.position.y, std::min(v0.position.y, v1.position.y))), 0, m_Height - 1);
+			pMax.x = Clamp(int(std::max(v2.position.x, std::max(v0.position.x, v1.position.x))), 0, m_Width - 1);
+			pMax.y = Clamp(int(std::max(v2.position.y, std::max(v0.position.y, v1.position.y))), 0, m_Height - 1);
 
 			// Loop over pixels
-			for (int px{ pMin.x }; px <= pMax.x; ++px) {
-				for (int py{ pMin.y }; py <= pMax.y; ++py) {
+			for (int py{ pMin.y }; py <= pMax.y; ++py) {
+				for (int px{ pMin.x }; px <= pMax.x; ++px) {
 
 					Vector2 pixel{ float(px),float(py) };
 
@@ -752,15 +976,15 @@ void Renderer::W2_TriangleStrip() {
 						w2 /= totalArea;
 
 						float interpolatedDepth{ w0 * v0.position.z + w1 * v1.position.z + w2 * v2.position.z };
-						bool depthTestPassed{ interpolatedDepth < m_pDepthBufferPixels[px + (py * m_Width)] };
+						bool depthTestPassed{ DepthFormat::IsCloser(DepthFormat::Encode(interpolatedDepth), m_pDepthBufferPixels[px + (py * m_Width)]) };
 
 						if (depthTestPassed) {
 
 							// Update Depth Buffer
-							m_pDepthBufferPixels[px + (py * m_Width)] = interpolatedDepth;
+							m_pDepthBufferPixels[px + (py * m_Width)] = DepthFormat::Encode(interpolatedDepth);
 
 							// Interpolated color
-							ColorRGB finalColor{ w0 * v0.color + w1 * v1.color + w2 * v2.color };
+							ColorRGB finalColor{ w0 * mesh.vertices[index0].color + w1 * mesh.vertices[index1].color + w2 * mesh.vertices[index2].color };
 
 							//Update Color in Buffer
 							finalColor.MaxToOne();
@@ -801,9 +1025,10 @@ void Renderer::W2_Textures() {
 		}
 	};
 
-	for (Mesh mesh : meshes_world) {
+	for (Mesh& mesh : meshes_world) {
 
 		VertexTransformationFunction(mesh);
+		PerspectiveDivide(mesh);
 
 		// Loop over triangles
 		for (int triangleIndex{ 0 }; triangleIndex + 2 < mesh.indices.size(); ++triangleIndex) {
@@ -842,14 +1067,14 @@ void Renderer::W2_Textures() {
 
 			// Find bounding box
 			Int2 pMin{}, pMax{};
-			pMin.x = Clamp(int(std::min(v2.position.x, std::min(v0.position.x, v1.position.x))), 0, m_Width);
-			pMin.y = Clamp(int(std::min(v2.position.y, std::min(v0.position.y, v1.position.y))), 0, m_Height);
-			pMax.x = Clamp(int(std::max(v2.position.x, std::max(v0.position.x, v1.position.x))), 0, m_Width);
-			pMax.y = Clamp(int(std::max(v2.position.y, std::max(v0.position.y, v1.position.y))), 0, m_Height);
+			pMin.x = Clamp(int(std::min(v2.position.x, std::min(v0.position.x, v1.position.x))), 0, m_Width - 1);
+			pMin.y = Clamp(int(std::min(v2.position.y, std::min(v0.position.y, v1.position.y))), 0, m_Height - 1);
+			pMax.x = Clamp(int(std::max(v2.position.x, std::max(v0.position.x, v1.position.x))), 0, m_Width - 1);
+			pMax.y = Clamp(int(std::max(v2.position.y, std::max(v0.position.y, v1.position.y))), 0, m_Height - 1);
 
 			// Loop over pixels
-			for (int px{ pMin.x }; px <= pMax.x; ++px) {
-				for (int py{ pMin.y }; py <= pMax.y; ++py) {
+			for (int py{ pMin.y }; py <= pMax.y; ++py) {
+				for (int px{ pMin.x }; px <= pMax.x; ++px) {
 
 					Vector2 pixel{ float(px),float(py) };
 
@@ -877,15 +1102,15 @@ void Renderer::W2_Textures() {
 						w2 /= totalArea;
 
 						float interpolatedDepth{ w0 * v0.position.z + w1 * v1.position.z + w2 * v2.position.z };
-						bool depthTestPassed{ interpolatedDepth < m_pDepthBufferPixels[px + (py * m_Width)] };
+						bool depthTestPassed{ DepthFormat::IsCloser(DepthFormat::Encode(interpolatedDepth), m_pDepthBufferPixels[px + (py * m_Width)]) };
 
 						if (depthTestPassed) {
 
 							// Update Depth Buffer
-							m_pDepthBufferPixels[px + (py * m_Width)] = interpolatedDepth;
+							m_pDepthBufferPixels[px + (py * m_Width)] = DepthFormat::Encode(interpolatedDepth);
 
 							// Interpolated color
-							ColorRGB finalColor{ w0 * v0.color + w1 * v1.color + w2 * v2.color };
+							ColorRGB finalColor{ w0 * mesh.vertices[index0].color + w1 * mesh.vertices[index1].color + w2 * mesh.vertices[index2].color };
 
 							// Interpolated UV
 							Vector2 interpolatedUV{ w0 * v0.uv + w1 * v1.uv + w2 * v2.uv };
@@ -908,255 +1133,1011 @@ void Renderer::W2_Textures() {
 
 void Renderer::RenderMeshes() {
 
-	std::vector<Mesh> meshes_world{
-		/*Mesh{
-			{
-				Vertex{{-3,3,-2},{}, {0,0}},
-				Vertex{{0,3,-2},{}, {0.5f,0}},
-				Vertex{{3,3,-2},{}, {1,0}},
-				Vertex{{-3,0,-2},{}, {0,0.5f}},
-				Vertex{{0,0,-2},{}, {0.5f,0.5f}},
-				Vertex{{3,0,-2},{}, {1,0.5f}},
-				Vertex{{-3,-3,-2},{}, {0,1}},
-				Vertex{{0,-3,-2},{}, {0.5f,1}},
-				Vertex{{3,-3,-2},{}, {1,1}},
-			},
-			{
-				3,0,4,1,5,2,
-				2,6,
-				6,3,7,4,8,5
-			},
-			PrimitiveTopology::TriangleStrip
-		}*/
-		* m_pObjectMesh,
-	};
+	// The toggles are resolved once here, the kernel has them compiled in and the earlier stages only produce what it reads
+	const TileKernelEntry& tileKernel{ GetTileKernel() };
+	m_MaterialAttributes = tileKernel.materialAttributes;
+
+	// Room for every triangle, the ones that get culled are simply left unused
+	size_t maxTriangles{};
+	uint32_t maxPlanesPerTriangle{};
+	for (const Mesh* pMesh : m_pMeshes) {
+		maxPlanesPerTriangle = std::max(maxPlanesPerTriangle, AttributePlaneCount(m_MaterialAttributes[size_t(pMesh->material)]));
+		if (pMesh->primitiveTopology == PrimitiveTopology::TriangleList) {
+			maxTriangles += pMesh->indices.size() / 3;
+		}
+		else if (pMesh->indices.size() > 2) {
+			maxTriangles += pMesh->indices.size() - 2;
+		}
+	}
+	AssembledTriangle* pAssembled{ m_pFrameArena->Allocate<AssembledTriangle>(maxTriangles) };
+	uint32_t assembledCount{};
+	uint32_t clippedCount{};
+
+	// Meshes are drawn nearest first, so the geometry in front fills the depth buffer before what it hides
+	Mesh** pDrawOrder{ m_pFrameArena->Allocate<Mesh*>(m_pMeshes.size()) };
+	std::copy(m_pMeshes.begin(), m_pMeshes.end(), pDrawOrder);
+	if (m_SortFrontToBack) {
+		std::sort(pDrawOrder, pDrawOrder + m_pMeshes.size(), [this](const Mesh* pA, const Mesh* pB) {
+			return GetDistanceToCamera(*pA, pA->boundsCenter, pA->boundsRadius) < GetDistanceToCamera(*pB, pB->boundsCenter, pB->boundsRadius);
+		});
+	}
 
-	for (Mesh mesh : meshes_world) {
+	for (size_t m{ 0 }; m < m_pMeshes.size(); ++m) {
 
-		VertexTransformationFunction(mesh);
+		Mesh* pMesh{ pDrawOrder[m] };
+		Mesh& mesh{ *pMesh };
 
-		// Loop over triangles
-		for (int triangleIndex{ 0 }; triangleIndex + 2 < mesh.indices.size(); ++triangleIndex) {
+		// Lazy mode only transforms the vertices the triangles actually use, the bits remember which ones are done this frame
+		// Positions are needed for culling, the other attributes only once a triangle survives it
+		VertexShaderContext context{};
+		uint64_t* pPositionDone{ nullptr };
+		uint64_t* pAttributesDone{ nullptr };
 
-			// Get correct indexes based on the mesh's topology
-			int index0{}, index1{}, index2{};
-			if (mesh.primitiveTopology == PrimitiveTopology::TriangleList) {
+		if (m_LazyVertexShading) {
+			mesh.vertices_out.resize(mesh.vertices.size());
+			mesh.varyings_out.resize(mesh.vertices.size() * VaryingCount(Materials::attributes[size_t(mesh.material)]));
+			context = GetVertexShaderContext(mesh);
 
-				index0 = mesh.indices[triangleIndex + 0];
-				index1 = mesh.indices[triangleIndex + 1];
-				index2 = mesh.indices[triangleIndex + 2];
-				triangleIndex += 2;
+			const size_t wordCount{ (mesh.vertices.size() + 63) / 64 };
+			pPositionDone = m_pFrameArena->Allocate<uint64_t>(wordCount);
+			pAttributesDone = m_pFrameArena->Allocate<uint64_t>(wordCount);
+			std::fill_n(pPositionDone, wordCount, 0);
+			std::fill_n(pAttributesDone, wordCount, 0);
+		}
+		else {
+			VertexTransformationFunction(mesh);
+		}
+
+		// Returns false the first time a vertex is asked for
+		auto TestAndSet = [](uint64_t* pBits, uint32_t vertexIndex) {
+			const uint64_t mask{ uint64_t(1) << (vertexIndex & 63) };
+			const bool isSet{ (pBits[vertexIndex >> 6] & mask) != 0 };
+			pBits[vertexIndex >> 6] |= mask;
+			return isSet;
+		};
+
+		// Index ranges to walk, the meshlets of a triangle list nearest first or else the whole index buffer
+		const Meshlet wholeMesh{ 0, uint32_t(mesh.indices.size()) };
+		const bool hasMeshlets{ mesh.primitiveTopology == PrimitiveTopology::TriangleList && !mesh.meshlets.empty() };
+		const uint32_t rangeCount{ hasMeshlets ? uint32_t(mesh.meshlets.size()) : 1 };
+
+		uint32_t* pRangeOrder{ m_pFrameArena->Allocate<uint32_t>(rangeCount) };
+		std::iota(pRangeOrder, pRangeOrder + rangeCount, 0);
+
+		if (hasMeshlets && m_SortFrontToBack) {
+			float* pDistances{ m_pFrameArena->Allocate<float>(rangeCount) };
+			for (uint32_t r{ 0 }; r < rangeCount; ++r) {
+				pDistances[r] = GetDistanceToCamera(mesh, mesh.meshlets[r].center, mesh.meshlets[r].radius);
 			}
+			std::sort(pRangeOrder, pRangeOrder + rangeCount, [pDistances](uint32_t a, uint32_t b) { return pDistances[a] < pDistances[b]; });
+		}
 
-			if (mesh.primitiveTopology == PrimitiveTopology::TriangleStrip) {
+		for (uint32_t r{ 0 }; r < rangeCount; ++r) {
 
-				index0 = mesh.indices[triangleIndex + 0];
-				if (triangleIndex % 2 == 0) {
+			const Meshlet& range{ hasMeshlets ? mesh.meshlets[pRangeOrder[r]] : wholeMesh };
+			const size_t rangeEnd{ size_t(range.firstIndex) + range.indexCount };
+
+			// Loop over triangles
+			for (size_t triangleIndex{ range.firstIndex }; triangleIndex + 2 < rangeEnd; ++triangleIndex) {
+
+				// Get correct indexes based on the mesh's topology
+				int index0{}, index1{}, index2{};
+				if (mesh.primitiveTopology == PrimitiveTopology::TriangleList) {
+
+					index0 = mesh.indices[triangleIndex + 0];
 					index1 = mesh.indices[triangleIndex + 1];
 					index2 = mesh.indices[triangleIndex + 2];
+					triangleIndex += 2;
 				}
-				else {
-					index1 = mesh.indices[triangleIndex + 2];
-					index2 = mesh.indices[triangleIndex + 1];
+
+				if (mesh.primitiveTopology == PrimitiveTopology::TriangleStrip) {
+
+					index0 = mesh.indices[triangleIndex + 0];
+					if (triangleIndex % 2 == 0) {
+						index1 = mesh.indices[triangleIndex + 1];
+						index2 = mesh.indices[triangleIndex + 2];
+					}
+					else {
+						index1 = mesh.indices[triangleIndex + 2];
+						index2 = mesh.indices[triangleIndex + 1];
+					}
+
+					if (index0 == index1 || index1 == index2 || index2 == index0) {
+						continue;
+					}
 				}
 
-				if (index0 == index1 || index1 == index2 || index2 == index0) {
+				if (m_LazyVertexShading) {
+					for (int vertexIndex : { index0, index1, index2 }) {
+						if (!TestAndSet(pPositionDone, uint32_t(vertexIndex))) {
+							TransformVertexPosition(mesh, context, uint32_t(vertexIndex));
+						}
+					}
+				}
+
+				// Culling triangles, only the ones that are completely outside one of the frustum planes
+				const Vector4& p0{ mesh.vertices_out[index0].position };
+				const Vector4& p1{ mesh.vertices_out[index1].position };
+				const Vector4& p2{ mesh.vertices_out[index2].position };
+				const uint32_t outCode0{ ComputeOutCode(p0) };
+				const uint32_t outCode1{ ComputeOutCode(p1) };
+				const uint32_t outCode2{ ComputeOutCode(p2) };
+				if ((outCode0 & outCode1 & outCode2 & m_FrustumOutCodes) != 0) {
 					continue;
 				}
+
+				// Face culling, triangles that are kept with their back facing us are flipped so setup only sees one winding
+				if (IsFaceCulled(p0, p1, p2, mesh.cullMode)) {
+					continue;
+				}
+				if (mesh.cullMode == CullMode::Front || (mesh.cullMode == CullMode::None && IsFaceCulled(p0, p1, p2, CullMode::Back))) {
+					std::swap(index1, index2);
+				}
+
+				if (m_LazyVertexShading) {
+					for (int vertexIndex : { index0, index1, index2 }) {
+						if (!TestAndSet(pAttributesDone, uint32_t(vertexIndex))) {
+							TransformVertexAttributes(mesh, context, uint32_t(vertexIndex));
+						}
+					}
+				}
+
+				// Only triangles crossing the near plane or leaving the guard band need the clipper
+				const bool needsClipping{ ((outCode0 | outCode1 | outCode2) & m_ClipOutCodes) != 0 };
+				pAssembled[assembledCount++] = { pMesh, uint32_t(index0), uint32_t(index1), uint32_t(index2), needsClipping };
+				clippedCount += needsClipping;
 			}
+		}
+	}
 
-			// Render triangle
-			Vertex_Out v0 = mesh.vertices_out[index0];
-			Vertex_Out v1 = mesh.vertices_out[index1];
-			Vertex_Out v2 = mesh.vertices_out[index2];
+	// A clipped triangle becomes a polygon with at most m_MaxClipVertices corners, so it adds at most that many - 3 triangles
+	const size_t maxTriangleCount{ assembledCount + size_t(clippedCount) * (m_MaxClipVertices - 3) };
+	m_pTriangles = m_pFrameArena->Allocate<Triangle>(maxTriangleCount);
+	m_pAttributePlanes = m_pFrameArena->Allocate<AttributePlane>(maxTriangleCount * maxPlanesPerTriangle);
+	m_TriangleCount = 0;
+	m_AttributePlaneCount = 0;
+
+	for (uint32_t i{ 0 }; i < assembledCount; ++i) {
+
+		const AssembledTriangle& assembled{ pAssembled[i] };
+		const Mesh& mesh{ *assembled.pMesh };
+		const uint32_t material{ uint32_t(mesh.material) };
+
+		// The varyings join their vertex here, only as many as the material declares
+		const uint32_t varyingCount{ VaryingCount(Materials::attributes[material]) };
+		const auto fetchVertex = [&](uint32_t vertexIndex) {
+			VaryingVertex vertex{ mesh.vertices_out[vertexIndex] };
+			std::copy_n(mesh.varyings_out.data() + size_t(vertexIndex) * varyingCount, varyingCount, vertex.varyings);
+			return vertex;
+		};
+		const VaryingVertex v0{ fetchVertex(assembled.index0) };
+		const VaryingVertex v1{ fetchVertex(assembled.index1) };
+		const VaryingVertex v2{ fetchVertex(assembled.index2) };
+
+		if (!assembled.needsClipping) {
+			AddTriangle(v0, v1, v2, material);
+			continue;
+		}
 
-			// Culling triangles
-			if (abs(v0.position.x) > 1 || abs(v0.position.y) > 1 || v0.position.z < 0 || v0.position.z > 1) {
-				continue;
+		VaryingVertex polygon[m_MaxClipVertices]{};
+		const int vertexCount{ ClipTriangle(v0, v1, v2, varyingCount, polygon) };
+		for (int v{ 1 }; v + 1 < vertexCount; ++v) {
+			AddTriangle(polygon[0], polygon[v], polygon[v + 1], material);
+		}
+	}
+
+	// Sort triangles into screen tiles and let the workers rasterize the tiles independently
+	BinTriangles();
+
+	const uint32_t tileCount{ uint32_t(m_TileCountX * m_TileCountY) };
+	DepthTestStats* pTileStats{ m_pFrameArena->Allocate<DepthTestStats>(tileCount) };
+
+	const TileKernel rasterizeTile{ tileKernel.rasterizeTile };
+
+	// A tile's scratch is released when it is done, so a worker never needs more than the largest bin takes,
+	// whichever tiles it ends up with
+	for (LinearAllocator* pArena : m_pWorkerArenas) {
+		pArena->Reserve(size_t(m_LargestBinSize) * sizeof(uint32_t) + alignof(uint32_t));
+	}
+
+	m_pThreadPool->ParallelFor(tileCount, [this, pTileStats, rasterizeTile](uint32_t tileIndex, uint32_t threadIndex) {
+		LinearAllocator& arena{ *m_pWorkerArenas[threadIndex] };
+		const size_t marker{ arena.GetMarker() };
+		pTileStats[tileIndex] = (this->*rasterizeTile)(int(tileIndex), arena);
+		arena.Rewind(marker);
+	});
+
+	m_DepthTestStats = {};
+	for (uint32_t i{ 0 }; i < tileCount; ++i) {
+		m_DepthTestStats.testCount += pTileStats[i].testCount;
+		m_DepthTestStats.failCount += pTileStats[i].failCount;
+	}
+}
+
+float Renderer::GetDistanceToCamera(const Mesh& mesh, const Vector3& center, float radius) const {
+
+	// Distance to the nearest point of the sphere, the radius follows the largest scale of the world matrix
+	const Vector3 worldCenter{ mesh.worldMatrix.TransformPoint(center) };
+	const float scale{ std::max(mesh.worldMatrix.GetAxisX().Magnitude(), std::max(mesh.worldMatrix.GetAxisY().Magnitude(), mesh.worldMatrix.GetAxisZ().Magnitude())) };
+	return (worldCenter - m_Camera.origin).Magnitude() - radius * scale;
+}
+
+uint32_t Renderer::ComputeOutCode(const Vector4& p) const {
+
+	uint32_t outCode{};
+	if (p.x < -p.w) outCode |= m_OutCodeLeft;
+	if (p.x > p.w) outCode |= m_OutCodeRight;
+	if (p.y < -p.w) outCode |= m_OutCodeBottom;
+	if (p.y > p.w) outCode |= m_OutCodeTop;
+	if (p.z < 0) outCode |= m_OutCodeNear;
+	if (p.z > p.w) outCode |= m_OutCodeFar;
+
+	if (p.x < -m_GuardBandX * p.w) outCode |= m_OutCodeGuardLeft;
+	if (p.x > m_GuardBandX * p.w) outCode |= m_OutCodeGuardRight;
+	if (p.y < -m_GuardBandY * p.w) outCode |= m_OutCodeGuardBottom;
+	if (p.y > m_GuardBandY * p.w) outCode |= m_OutCodeGuardTop;
+	return outCode;
+}
+
+int Renderer::ClipTriangle(const VaryingVertex& v0, const VaryingVertex& v1, const VaryingVertex& v2, uint32_t varyingCount, VaryingVertex* pPolygon) const {
+
+	// Sutherland-Hodgman in clip space, every plane is a signed distance that is positive on the inside
+	// The near plane is always there, the guard band planes only matter for the rare huge triangle
+	const auto distance = [this](const Vector4& p, int plane) {
+		switch (plane) {
+		case 0: return p.z;
+		case 1: return m_GuardBandX * p.w + p.x;
+		case 2: return m_GuardBandX * p.w - p.x;
+		case 3: return m_GuardBandY * p.w + p.y;
+		default: return m_GuardBandY * p.w - p.y;
+		}
+	};
+
+	const auto lerp = [varyingCount](const VaryingVertex& a, const VaryingVertex& b, float t) {
+		VaryingVertex result{};
+		result.position = a.position + (b.position - a.position) * t;
+		result.uv = a.uv + (b.uv - a.uv) * t;
+		result.normal = a.normal + (b.normal - a.normal) * t;
+		result.tangent = a.tangent + (b.tangent - a.tangent) * t;
+		result.viewDirection = a.viewDirection + (b.viewDirection - a.viewDirection) * t;
+		for (uint32_t i{ 0 }; i < varyingCount; ++i) {
+			result.varyings[i] = a.varyings[i] + (b.varyings[i] - a.varyings[i]) * t;
+		}
+		return result;
+	};
+
+	VaryingVertex buffer[m_MaxClipVertices]{};
+	VaryingVertex* pIn{ pPolygon };
+	VaryingVertex* pOut{ buffer };
+
+	pIn[0] = v0;
+	pIn[1] = v1;
+	pIn[2] = v2;
+	int count{ 3 };
+
+	for (int plane{ 0 }; plane < 5 && count > 0; ++plane) {
+
+		int outCount{ 0 };
+		for (int i{ 0 }; i < count; ++i) {
+
+			const VaryingVertex& current{ pIn[i] };
+			const VaryingVertex& next{ pIn[(i + 1) % count] };
+			const float currentDistance{ distance(current.position, plane) };
+			const float nextDistance{ distance(next.position, plane) };
+
+			if (currentDistance >= 0) {
+				pOut[outCount++] = current;
 			}
-			if (abs(v1.position.x) > 1 || abs(v1.position.y) > 1 || v1.position.z < 0 || v1.position.z > 1) {
-				continue;
+			if ((currentDistance >= 0) != (nextDistance >= 0)) {
+				pOut[outCount++] = lerp(current, next, currentDistance / (currentDistance - nextDistance));
+			}
+		}
+
+		std::swap(pIn, pOut);
+		count = outCount;
+	}
+
+	// An odd number of planes leaves the result in the scratch buffer
+	if (pIn != pPolygon) {
+		std::copy_n(pIn, count, pPolygon);
+	}
+	return count;
+}
+
+void Renderer::AddTriangle(VaryingVertex v0, VaryingVertex v1, VaryingVertex v2, uint32_t material) {
+
+	// Perspective divide
+	for (VaryingVertex* pVertex : { &v0, &v1, &v2 }) {
+		pVertex->position.x /= pVertex->position.w;
+		pVertex->position.y /= pVertex->position.w;
+		pVertex->position.z /= pVertex->position.w;
+	}
+
+	// To Screen Space
+	v0.position.x = (v0.position.x + 1) * m_Width / 2;
+	v0.position.y = (-v0.position.y + 1) * m_Height / 2;
+	v1.position.x = (v1.position.x + 1) * m_Width / 2;
+	v1.position.y = (-v1.position.y + 1) * m_Height / 2;
+	v2.position.x = (v2.position.x + 1) * m_Width / 2;
+	v2.position.y = (-v2.position.y + 1) * m_Height / 2;
+
+	// Find bounding box, clamping it to the screen is the scissor for everything inside the guard band
+	Triangle triangle{};
+	triangle.pMin.x = Clamp(int(std::min(v2.position.x, std::min(v0.position.x, v1.position.x))), 0, m_Width - 1);
+	triangle.pMin.y = Clamp(int(std::min(v2.position.y, std::min(v0.position.y, v1.position.y))), 0, m_Height - 1);
+	triangle.pMax.x = Clamp(int(std::max(v2.position.x, std::max(v0.position.x, v1.position.x))), 0, m_Width - 1);
+	triangle.pMax.y = Clamp(int(std::max(v2.position.y, std::max(v0.position.y, v1.position.y))), 0, m_Height - 1);
+
+	// The planes go right after the ones of the previous triangle, a triangle that gets dropped leaves them to the next one
+	triangle.material = material;
+	triangle.firstPlane = m_AttributePlaneCount;
+	if (SetupTriangle(triangle, m_pAttributePlanes + m_AttributePlaneCount, v0, v1, v2)) {
+		m_pTriangles[m_TriangleCount++] = triangle;
+		m_AttributePlaneCount += AttributePlaneCount(m_MaterialAttributes[material]);
+	}
+}
+
+bool Renderer::IsFaceCulled(const Vector4& p0, const Vector4& p1, const Vector4& p2, CullMode cullMode) const {
+
+	if (cullMode == CullMode::None) {
+		return false;
+	}
+
+	// Determinant of the x, y, w rows, it has the sign of the NDC area as long as all w's are positive
+	// but unlike the NDC area it stays right for triangles that cross the near plane
+	// y points up here so front faces have a negative determinant
+	const float determinant{ p0.w * (p1.x * p2.y - p2.x * p1.y) - p1.w * (p0.x * p2.y - p2.x * p0.y) + p2.w * (p0.x * p1.y - p1.x * p0.y) };
+	return cullMode == CullMode::Back ? determinant >= 0 : determinant <= 0;
+}
+
+bool Renderer::SetupTriangle(Triangle& triangle, AttributePlane* pPlanes, const VaryingVertex& v0, const VaryingVertex& v1, const VaryingVertex& v2) const {
+
+	// Snap the vertices to the subpixel grid
+	const int x0{ int(lroundf(v0.position.x * SUBPIXEL_STEP)) };
+	const int y0{ int(lroundf(v0.position.y * SUBPIXEL_STEP)) };
+	const int x1{ int(lroundf(v1.position.x * SUBPIXEL_STEP)) };
+	const int y1{ int(lroundf(v1.position.y * SUBPIXEL_STEP)) };
+	const int x2{ int(lroundf(v2.position.x * SUBPIXEL_STEP)) };
+	const int y2{ int(lroundf(v2.position.y * SUBPIXEL_STEP)) };
+
+	// Twice the signed area, triangles facing away or without area never cover a pixel
+	const int64_t area{ int64_t(x1 - x0) * (y2 - y0) - int64_t(y1 - y0) * (x2 - x0) };
+	if (area <= 0) {
+		return false;
+	}
+	const float invArea{ 1.0f / float(area) };
+
+	const auto makeEdge = [](int xa, int ya, int xb, int yb) {
+		EdgeFunction edge{};
+		edge.a = ya - yb;
+		edge.b = xb - xa;
+		edge.c = int64_t(xa) * yb - int64_t(ya) * xb;
+
+		// Top-left rule: pixels exactly on an edge only belong to the triangle if it is a left or a top edge
+		const bool isTopLeft{ edge.a > 0 || (edge.a == 0 && edge.b > 0) };
+		edge.c += isTopLeft ? 0 : -1;
+		return edge;
+	};
+
+	triangle.edges[0] = makeEdge(x1, y1, x2, y2);
+	triangle.edges[1] = makeEdge(x2, y2, x0, y0);
+	triangle.edges[2] = makeEdge(x0, y0, x1, y1);
+
+	// Attribute planes, the weight of vertex i changes by edges[i].a / area per subpixel step in x
+	// Around the first vertex only the weights of the other two vertices change, which keeps the plane values small
+	const float weight1X{ triangle.edges[1].a * SUBPIXEL_STEP * invArea };
+	const float weight1Y{ triangle.edges[1].b * SUBPIXEL_STEP * invArea };
+	const float weight2X{ triangle.edges[2].a * SUBPIXEL_STEP * invArea };
+	const float weight2Y{ triangle.edges[2].b * SUBPIXEL_STEP * invArea };
+
+	const auto makePlane = [&](float value0, float value1, float value2) {
+		return AttributePlane{ value0,
+			(value1 - value0) * weight1X + (value2 - value0) * weight2X,
+			(value1 - value0) * weight1Y + (value2 - value0) * weight2Y };
+	};
+
+	triangle.planeOriginX = float(x0) / SUBPIXEL_STEP - 0.5f;
+	triangle.planeOriginY = float(y0) / SUBPIXEL_STEP - 0.5f;
+
+	triangle.depth = makePlane(v0.position.z, v1.position.z, v2.position.z);
+	triangle.minDepth = std::min(v0.position.z, std::min(v1.position.z, v2.position.z)) - m_HiZDepthMargin;
+	triangle.maxDepth = std::max(v0.position.z, std::max(v1.position.z, v2.position.z)) + m_HiZDepthMargin;
+
+	// Only the planes the triangle's material evaluates get stored, in the order AttributePlaneOffset expects
+	const uint32_t attributes{ m_MaterialAttributes[triangle.material] };
+	if (attributes == 0) {
+		return true;
+	}
+
+	const float invW0{ 1.f / v0.position.w };
+	const float invW1{ 1.f / v1.position.w };
+	const float invW2{ 1.f / v2.position.w };
+
+	AttributePlane* pPlane{ pPlanes };
+	*pPlane++ = makePlane(invW0, invW1, invW2);
+
+	if (attributes & ATTRIBUTE_UV) {
+		*pPlane++ = makePlane(v0.uv.x * invW0, v1.uv.x * invW1, v2.uv.x * invW2);
+		*pPlane++ = makePlane(v0.uv.y * invW0, v1.uv.y * invW1, v2.uv.y * invW2);
+	}
+
+	const auto addVectorPlanes = [&](const Vector3& value0, const Vector3& value1, const Vector3& value2) {
+		for (int c{ 0 }; c < 3; ++c) {
+			*pPlane++ = makePlane(value0[c] * invW0, value1[c] * invW1, value2[c] * invW2);
+		}
+	};
+	if (attributes & ATTRIBUTE_NORMAL) {
+		addVectorPlanes(v0.normal, v1.normal, v2.normal);
+	}
+	if (attributes & ATTRIBUTE_TANGENT) {
+		addVectorPlanes(v0.tangent, v1.tangent, v2.tangent);
+	}
+	if (attributes & ATTRIBUTE_VIEW_DIRECTION) {
+		addVectorPlanes(v0.viewDirection, v1.viewDirection, v2.viewDirection);
+	}
+	for (uint32_t i{ 0 }; i < MAX_VARYINGS; ++i) {
+		if (attributes & (ATTRIBUTE_VARYING0 << i)) {
+			*pPlane++ = makePlane(v0.varyings[i] * invW0, v1.varyings[i] * invW1, v2.varyings[i] * invW2);
+		}
+	}
+
+	return true;
+}
+
+void Renderer::BinTriangles() {
+
+	const uint32_t tileCount{ uint32_t(m_TileCountX * m_TileCountY) };
+
+	// Counting sort: first count the triangles per tile, then hand out the ranges and fill them
+	m_pTileBinOffsets = m_pFrameArena->Allocate<uint32_t>(size_t(tileCount) + 1);
+	uint32_t* pTileFill{ m_pFrameArena->Allocate<uint32_t>(tileCount) };
+	std::fill_n(pTileFill, tileCount, 0);
+
+	const auto forEachTile = [this](const Triangle& triangle, const auto& function) {
+		const int tileMinX{ triangle.pMin.x / m_TileSize };
+		const int tileMinY{ triangle.pMin.y / m_TileSize };
+		const int tileMaxX{ triangle.pMax.x / m_TileSize };
+		const int tileMaxY{ triangle.pMax.y / m_TileSize };
+
+		for (int ty{ tileMinY }; ty <= tileMaxY; ++ty) {
+			for (int tx{ tileMinX }; tx <= tileMaxX; ++tx) {
+				function(tx + (ty * m_TileCountX));
+			}
+		}
+	};
+
+	for (uint32_t triangleIndex{ 0 }; triangleIndex < m_TriangleCount; ++triangleIndex) {
+		forEachTile(m_pTriangles[triangleIndex], [&](int tileIndex) { ++pTileFill[tileIndex]; });
+	}
+
+	uint32_t totalEntries{};
+	m_LargestBinSize = 0;
+	for (uint32_t tileIndex{ 0 }; tileIndex < tileCount; ++tileIndex) {
+		m_pTileBinOffsets[tileIndex] = totalEntries;
+		totalEntries += pTileFill[tileIndex];
+		m_LargestBinSize = std::max(m_LargestBinSize, pTileFill[tileIndex]);
+		pTileFill[tileIndex] = m_pTileBinOffsets[tileIndex];
+	}
+	m_pTileBinOffsets[tileCount] = totalEntries;
+
+	// Add the triangle to every tile its bounding box overlaps, in submission order
+	m_pTileBinTriangles = m_pFrameArena->Allocate<uint32_t>(totalEntries);
+	for (uint32_t triangleIndex{ 0 }; triangleIndex < m_TriangleCount; ++triangleIndex) {
+		forEachTile(m_pTriangles[triangleIndex], [&](int tileIndex) { m_pTileBinTriangles[pTileFill[tileIndex]++] = triangleIndex; });
+	}
+}
+
+namespace
+{
+	// Tile kernel table index to render state: bits 0-1 phong render mode, bit 2 phong normal map, bit 3 visibility buffer, bits 4-5 debug view
+	// Every kernel gets the whole material list, the phong bits only pick its variant of the phong material
+	// The debug views don't shade, so all indices of one debug view share a single kernel
+	template<size_t index>
+	using KernelState = RenderState<
+		MaterialVariants<DebugView(index >> 4) == DebugView::none ? RenderMode(index & 3) : RenderMode::combined,
+			DebugView(index >> 4) == DebugView::none && (index & 4) != 0>,
+		DebugView(index >> 4),
+		DebugView(index >> 4) != DebugView::boundingBoxes && (index & 8) != 0>;
+}
+
+template<size_t... indices>
+constexpr std::array<Renderer::TileKernelEntry, sizeof...(indices)> Renderer::MakeTileKernels(std::index_sequence<indices...>) {
+	return { TileKernelEntry{ &Renderer::RasterizeTile<KernelState<indices>>, KernelState<indices>::materialAttributes }... };
+}
+
+const Renderer::TileKernelEntry& Renderer::GetTileKernel() const {
+
+	static constexpr std::array<TileKernelEntry, m_TileKernelCount> tileKernels{ MakeTileKernels(std::make_index_sequence<m_TileKernelCount>{}) };
+
+	// Bounding boxes win over the depth view, like they always did
+	const DebugView debugView{ m_VisualizeBoundingBoxes ? DebugView::boundingBoxes : m_VisualizeDepthBuffer ? DebugView::depthBuffer : DebugView::none };
+	return tileKernels[int(m_RenderMode) | (int(m_UseNormalMap) << 2) | (int(m_UseVisibilityBuffer) << 3) | (int(debugView) << 4)];
+}
+
+template<typename State>
+Renderer::DepthTestStats Renderer::RasterizeTile(int tileIndex, LinearAllocator& arena) const {
+
+	const Int2 tileMin{ (tileIndex % m_TileCountX) * m_TileSize, (tileIndex / m_TileCountX) * m_TileSize };
+	const Int2 tileMax{ std::min(tileMin.x + m_TileSize, m_Width) - 1, std::min(tileMin.y + m_TileSize, m_Height) - 1 };
+
+	const uint32_t* pBin{ m_pTileBinTriangles + m_pTileBinOffsets[tileIndex] };
+	const uint32_t binSize{ m_pTileBinOffsets[tileIndex + 1] - m_pTileBinOffsets[tileIndex] };
+
+	// Visibility list: drop the triangles whose bounding box overlaps the tile while the triangle itself doesn't
+	uint32_t* pVisible{ arena.Allocate<uint32_t>(binSize) };
+	uint32_t visibleCount{};
+
+	const int64_t tileMinX{ (int64_t(tileMin.x) << SUBPIXEL_BITS) + SUBPIXEL_HALF };
+	const int64_t tileMinY{ (int64_t(tileMin.y) << SUBPIXEL_BITS) + SUBPIXEL_HALF };
+	const int64_t tileMaxX{ (int64_t(tileMax.x) << SUBPIXEL_BITS) + SUBPIXEL_HALF };
+	const int64_t tileMaxY{ (int64_t(tileMax.y) << SUBPIXEL_BITS) + SUBPIXEL_HALF };
+
+	for (uint32_t i{ 0 }; i < binSize; ++i) {
+		const Triangle& triangle{ m_pTriangles[pBin[i]] };
+
+		// The tile corner where the edge function is highest, if that one is outside the whole tile is
+		bool isOutside{ false };
+		for (const EdgeFunction& edge : triangle.edges) {
+			const int64_t x{ edge.a > 0 ? tileMaxX : tileMinX };
+			const int64_t y{ edge.b > 0 ? tileMaxY : tileMinY };
+			isOutside |= edge.a * x + edge.b * y + edge.c < 0;
+		}
+
+		if (!isOutside || State::debugView == DebugView::boundingBoxes) {
+			pVisible[visibleCount++] = pBin[i];
+		}
+	}
+
+	// Left alone when nothing is drawn here, the color gets resolved at present time and depth is never read
+	if (visibleCount == 0) {
+		return {};
+	}
+	ClearTile(tileIndex, tileMin, tileMax);
+
+	if constexpr (State::useVisibilityBuffer) {
+		for (int py{ tileMin.y }; py <= tileMax.y; ++py) {
+			std::fill_n(m_pVisibilityBufferPixels + tileMin.x + (py * m_Width), tileMax.x - tileMin.x + 1, m_EmptyVisibility);
+		}
+	}
+
+	// Farthest depth in the whole tile, a triangle that starts behind it can't pass a single depth test
+	const auto computeTileMaxDepth = [&]() {
+		float maxDepth{};
+		for (int by{ tileMin.y / COARSE_BLOCK_SIZE }; by <= tileMax.y / COARSE_BLOCK_SIZE; ++by) {
+			for (int bx{ tileMin.x / COARSE_BLOCK_SIZE }; bx <= tileMax.x / COARSE_BLOCK_SIZE; ++bx) {
+				maxDepth = std::max(maxDepth, m_pHiZMaxDepth[bx + (by * m_HiZWidth)]);
 			}
-			if (abs(v2.position.x) > 1 || abs(v2.position.y) > 1 || v2.position.z < 0 || v2.position.z > 1) {
+		}
+		return maxDepth;
+	};
+	float tileMaxDepth{ computeTileMaxDepth() };
+
+	// With the pre-pass the first loop only lays down depth
+	const bool useDepthPrePass{ m_UseDepthPrePass && State::debugView != DebugView::boundingBoxes };
+	DepthTestStats stats{};
+
+	for (uint32_t i{ 0 }; i < visibleCount; ++i) {
+		const Triangle& triangle{ m_pTriangles[pVisible[i]] };
+		if (triangle.minDepth >= tileMaxDepth && State::debugView != DebugView::boundingBoxes) {
+			continue;
+		}
+
+		const bool hasLoweredMaxDepth{ useDepthPrePass ?
+			RasterizeTriangle<State, RasterPass::depthOnly>(triangle, tileMin, tileMax, stats) :
+			RasterizeTriangle<State, RasterPass::forward>(triangle, tileMin, tileMax, stats) };
+		if (hasLoweredMaxDepth) {
+			tileMaxDepth = computeTileMaxDepth();
+		}
+	}
+
+	// Then only the fragments that ended up with exactly the depth in the buffer get shaded
+	if (useDepthPrePass) {
+		for (uint32_t i{ 0 }; i < visibleCount; ++i) {
+			const Triangle& triangle{ m_pTriangles[pVisible[i]] };
+			if (triangle.minDepth > tileMaxDepth) {
 				continue;
 			}
 
-			// To Screen Space
-			v0.position.x = (v0.position.x + 1) * m_Width / 2;
-			v0.position.y = (-v0.position.y + 1) * m_Height / 2;
-			v1.position.x = (v1.position.x + 1) * m_Width / 2;
-			v1.position.y = (-v1.position.y + 1) * m_Height / 2;
-			v2.position.x = (v2.position.x + 1) * m_Width / 2;
-			v2.position.y = (-v2.position.y + 1) * m_Height / 2;
+			RasterizeTriangle<State, RasterPass::depthEqual>(triangle, tileMin, tileMax, stats);
+		}
+	}
+
+	// Nothing else touches this tile, so its visibility is final and every pixel can be shaded exactly once
+	if constexpr (State::useVisibilityBuffer) {
+		ResolveVisibilityTile<State>(tileMin, tileMax);
+	}
 
-			// Find bounding box
-			Int2 pMin{}, pMax{};
-			pMin.x = Clamp(int(std::min(v2.position.x, std::min(v0.position.x, v1.position.x))), 0, m_Width);
-			pMin.y = Clamp(int(std::min(v2.position.y, std::min(v0.position.y, v1.position.y))), 0, m_Height);
-			pMax.x = Clamp(int(std::max(v2.position.x, std::max(v0.position.x, v1.position.x))), 0, m_Width);
-			pMax.y = Clamp(int(std::max(v2.position.y, std::max(v0.position.y, v1.position.y))), 0, m_Height);
+	return stats;
+}
 
-			// Loop over pixels
-			for (int px{ pMin.x }; px <= pMax.x; ++px) {
-				for (int py{ pMin.y }; py <= pMax.y; ++py) {
+template<typename State>
+void Renderer::ResolveVisibilityTile(const Int2& tileMin, const Int2& tileMax) const {
 
-					// Visualize the bouding boxes
-					if (m_VisualizeBoundingBoxes) {
-						m_pBackBufferPixels[px + (py * m_Width)] = SDL_MapRGB(m_pBackBuffer->format,
-							static_cast<uint8_t>(255),
-							static_cast<uint8_t>(255),
-							static_cast<uint8_t>(255));
-						continue;
+	// Tiles start on even pixels, so the quads line up with the ones of the forward path
+	for (int quadY{ tileMin.y }; quadY <= tileMax.y; quadY += 2) {
+		for (int quadX{ tileMin.x }; quadX <= tileMax.x; quadX += 2) {
+
+			uint32_t triangleIndices[4]{};
+			uint32_t pendingMask{};
+			for (int lane{ 0 }; lane < 4; ++lane) {
+				const int px{ quadX + (lane & 1) };
+				const int py{ quadY + (lane >> 1) };
+				if (px > tileMax.x || py > tileMax.y) {
+					continue;
+				}
+
+				triangleIndices[lane] = m_pVisibilityBufferPixels[px + (py * m_Width)];
+				if (triangleIndices[lane] != m_EmptyVisibility) {
+					pendingMask |= 1u << lane;
+				}
+			}
+
+			// Lanes that show the same triangle are shaded together, for every other triangle in the quad they are helpers
+			while (pendingMask != 0) {
+				const uint32_t triangleIndex{ triangleIndices[std::countr_zero(pendingMask)] };
+
+				uint32_t laneMask{};
+				for (int lane{ 0 }; lane < 4; ++lane) {
+					if ((pendingMask & (1u << lane)) != 0 && triangleIndices[lane] == triangleIndex) {
+						laneMask |= 1u << lane;
 					}
+				}
 
-					Vector2 pixel{ float(px),float(py) };
+				ShadeQuad<State>(m_pTriangles[triangleIndex], quadX, quadY, laneMask);
+				pendingMask &= ~laneMask;
+			}
+		}
+	}
+}
 
-					//Side A
-					Vector2 side{ v1.position.GetXY() - v0.position.GetXY() };
-					Vector2 pointToSide{ pixel - v0.position.GetXY() };
-					float w2{ Vector2::Cross(side,pointToSide) };
+template<typename State, RasterPass pass>
+bool Renderer::RasterizeTriangle(const Triangle& triangle, const Int2& tileMin, const Int2& tileMax, DepthTestStats& stats) const {
 
-					//Side B
-					side = { v2.position.GetXY() - v1.position.GetXY() };
-					pointToSide = { pixel - v1.position.GetXY() };
-					float w0{ Vector2::Cross(side,pointToSide) };
+	// Only touch the part of the bounding box inside this tile
+	Int2 pMin{ std::max(triangle.pMin.x, tileMin.x), std::max(triangle.pMin.y, tileMin.y) };
+	Int2 pMax{ std::min(triangle.pMax.x, tileMax.x), std::min(triangle.pMax.y, tileMax.y) };
 
-					//Side C
-					side = { v0.position.GetXY() - v2.position.GetXY() };
-					pointToSide = { pixel - v2.position.GetXY() };
-					float w1{ Vector2::Cross(side,pointToSide) };
+	// Visualize the bouding boxes
+	if constexpr (State::debugView == DebugView::boundingBoxes) {
+		const uint32_t white{ SDL_MapRGB(m_pBackBuffer->format, 255, 255, 255) };
+		for (int py{ pMin.y }; py <= pMax.y; ++py) {
+			std::fill_n(m_pBackBufferPixels + pMin.x + (py * m_Width), pMax.x - pMin.x + 1, white);
+		}
+		return false;
+	}
 
-					if (w0 >= 0 && w1 >= 0 && w2 >= 0) {
+	// Walk whole coarse blocks, tiles are a multiple of the coarse block size so a block never leaves its tile
+	const Int2 coarseMin{ pMin.x - (pMin.x % COARSE_BLOCK_SIZE), pMin.y - (pMin.y % COARSE_BLOCK_SIZE) };
 
-						// Calculate Barycentric weights
-						const float totalArea = w0 + w1 + w2;
-						w0 /= totalArea;
-						w1 /= totalArea;
-						w2 /= totalArea;
+	// Edge values at the center of the first pixel, from there on they are stepped by addition
+	const int64_t sampleX{ (int64_t(coarseMin.x) << SUBPIXEL_BITS) + SUBPIXEL_HALF };
+	const int64_t sampleY{ (int64_t(coarseMin.y) << SUBPIXEL_BITS) + SUBPIXEL_HALF };
 
-						float interpolatedDepth{ 1.0f / (w0 * (1 / v0.position.z) + w1 * (1 / v1.position.z) + w2 * (1 / v2.position.z)) };
-						bool depthTestPassed{ interpolatedDepth < m_pDepthBufferPixels[px + (py * m_Width)] };
+	int64_t rowW[3]{};
+	int64_t stepX[3]{}, stepY[3]{};
 
-						if (depthTestPassed) {
+	// Offsets from the first pixel of a coarse block to the corner where the edge value is lowest and highest
+	int64_t cornerMin[3]{}, cornerMax[3]{};
 
-							// Update Depth Buffer
-							m_pDepthBufferPixels[px + (py * m_Width)] = interpolatedDepth;
+	BlockEdges blockEdges{};
+	for (int e{}; e < 3; ++e) {
+		const EdgeFunction& edge{ triangle.edges[e] };
+		rowW[e] = edge.a * sampleX + edge.b * sampleY + edge.c;
+
+		blockEdges.stepX[e] = edge.a * SUBPIXEL_STEP;
+		blockEdges.stepY[e] = edge.b * SUBPIXEL_STEP;
+		stepX[e] = blockEdges.stepX[e];
+		stepY[e] = blockEdges.stepY[e];
 
-							// Visualize the depth buffer
-							if (m_VisualizeDepthBuffer) {
+		const int64_t spanX{ stepX[e] * (COARSE_BLOCK_SIZE - 1) };
+		const int64_t spanY{ stepY[e] * (COARSE_BLOCK_SIZE - 1) };
+		cornerMin[e] = std::min(spanX, int64_t(0)) + std::min(spanY, int64_t(0));
+		cornerMax[e] = std::max(spanX, int64_t(0)) + std::max(spanY, int64_t(0));
+	}
 
-								float depthColor{ Remap(interpolatedDepth, 0.997f, 1.0f) };
+	// Same idea for the depth plane, which bounds the depth of the triangle inside a coarse block
+	const float depthSpanX{ triangle.depth.dx * (COARSE_BLOCK_SIZE - 1) };
+	const float depthSpanY{ triangle.depth.dy * (COARSE_BLOCK_SIZE - 1) };
+	const float depthCornerMin{ std::min(depthSpanX, 0.f) + std::min(depthSpanY, 0.f) - m_HiZDepthMargin };
+	const float depthCornerMax{ std::max(depthSpanX, 0.f) + std::max(depthSpanY, 0.f) + m_HiZDepthMargin };
 
-								m_pBackBufferPixels[px + (py * m_Width)] = SDL_MapRGB(m_pBackBuffer->format,
-									static_cast<uint8_t>(depthColor * 255),
-									static_cast<uint8_t>(depthColor * 255),
-									static_cast<uint8_t>(depthColor * 255));
-								continue;
-							}
+	bool hasLoweredMaxDepth{ false };
 
+	// Loop over coarse blocks
+	for (int cy{ coarseMin.y }; cy <= pMax.y; cy += COARSE_BLOCK_SIZE) {
 
+		int64_t coarseW[3]{ rowW[0], rowW[1], rowW[2] };
 
-							// InterpolatedW
-							float interpolatedW{ 1.0f / (w0 * (1 / v0.position.w) + w1 * (1 / v1.position.w) + w2 * (1 / v2.position.w)) };
+		for (int cx{ coarseMin.x }; cx <= pMax.x; cx += COARSE_BLOCK_SIZE) {
 
-							// Interpolated UV
-							Vector2 interpolatedUV{ w0 * (v0.uv / v0.position.w) + w1 * (v1.uv / v1.position.w) + w2 * (v2.uv / v2.position.w) };
-							interpolatedUV *= interpolatedW;
+			// The edge functions are linear, so checking the corners classifies the whole block
+			bool isOutside{ false };
+			bool isInside{ true };
+			for (int e{}; e < 3; ++e) {
+				isOutside |= coarseW[e] + cornerMax[e] < 0;
+				isInside &= coarseW[e] + cornerMin[e] >= 0;
+			}
 
-							// Interpolated Normal
-							Vector3 InterpolatedNormal{ w0 * (v0.normal / v0.position.w) + w1 * (v1.normal / v1.position.w) + w2 * (v2.normal / v2.position.w) };
-							InterpolatedNormal *= interpolatedW;
+			// Hi-Z: skip the block when the triangle is behind everything in it
+			// and skip the depth reads when it is in front of everything in it
+			const int hiZIndex{ cx / COARSE_BLOCK_SIZE + (cy / COARSE_BLOCK_SIZE) * m_HiZWidth };
+			const float blockDepth{ triangle.depth.Evaluate(float(cx) - triangle.planeOriginX, float(cy) - triangle.planeOriginY) };
+			const float blockMinDepth{ std::max(blockDepth + depthCornerMin, triangle.minDepth) };
+			const float blockMaxDepth{ std::min(blockDepth + depthCornerMax, triangle.maxDepth) };
 
-							// Interpolated Tangent
-							Vector3 InterpolatedTangent{ w0 * (v0.tangent / v0.position.w) + w1 * (v1.tangent / v1.position.w) + w2 * (v2.tangent / v2.position.w) };
-							InterpolatedTangent *= interpolatedW;
+			// The equal pass can still match a depth that sits exactly on one of the bounds
+			if constexpr (pass == RasterPass::depthEqual) {
+				isOutside |= blockMinDepth > m_pHiZMaxDepth[hiZIndex] || blockMaxDepth < m_pHiZMinDepth[hiZIndex];
+			}
+			else {
+				isOutside |= blockMinDepth >= m_pHiZMaxDepth[hiZIndex];
+			}
+			const bool isInFront{ blockMaxDepth < m_pHiZMinDepth[hiZIndex] };
 
-							// Interpolated view direction
-							Vector3 InterpolatedViewDirection{ w0 * (v0.viewDirection / v0.position.w) + w1 * (v1.viewDirection / v1.position.w) + w2 * (v2.viewDirection / v2.position.w) };
-							InterpolatedViewDirection *= interpolatedW;
+			if (!isOutside && pass != RasterPass::depthEqual) {
 
-							Vertex_Out pixelVertex{};
-							pixelVertex.position = { pixel.x, pixel.y, interpolatedDepth, interpolatedW };
-							pixelVertex.uv = interpolatedUV;
-							pixelVertex.normal = InterpolatedNormal.Normalized();
-							pixelVertex.tangent = InterpolatedTangent.Normalized();
-							pixelVertex.viewDirection = InterpolatedViewDirection.Normalized();
+				// Only ever moves the bounds closer to the real range, any depth written here is at least blockMinDepth
+				// and when the block is fully covered every pixel ends up at blockMaxDepth or nearer
+				m_pHiZMinDepth[hiZIndex] = std::min(m_pHiZMinDepth[hiZIndex], blockMinDepth);
+				if (isInside && blockMaxDepth < m_pHiZMaxDepth[hiZIndex]) {
+					m_pHiZMaxDepth[hiZIndex] = blockMaxDepth;
+					hasLoweredMaxDepth = true;
+				}
+			}
 
-							ColorRGB finalColor{ PixelShading(pixelVertex) };
+			if (!isOutside) {
 
-							//Update Color in Buffer
-							finalColor.MaxToOne();
+				// Loop over the 4x2 blocks of this coarse block
+				for (int by{ cy }; by < cy + COARSE_BLOCK_SIZE && by <= pMax.y; by += BLOCK_HEIGHT) {
 
-							m_pBackBufferPixels[px + (py * m_Width)] = SDL_MapRGB(m_pBackBuffer->format,
-								static_cast<uint8_t>(finalColor.r * 255),
-								static_cast<uint8_t>(finalColor.g * 255),
-								static_cast<uint8_t>(finalColor.b * 255));
+					// Rows of the block that are inside the bounding box
+					uint32_t rowMask{};
+					for (int dy{}; dy < BLOCK_HEIGHT; ++dy) {
+						if (by + dy >= pMin.y && by + dy <= pMax.y) {
+							rowMask |= ((1u << BLOCK_WIDTH) - 1) << (dy * BLOCK_WIDTH);
+						}
+					}
+
+					for (int bx{ cx }; bx < cx + COARSE_BLOCK_SIZE && bx <= pMax.x; bx += BLOCK_WIDTH) {
+
+						// Columns of the block that are inside the bounding box
+						uint32_t boxMask{};
+						for (int dx{}; dx < BLOCK_WIDTH; ++dx) {
+							if (bx + dx >= pMin.x && bx + dx <= pMax.x) {
+								for (int dy{}; dy < BLOCK_HEIGHT; ++dy) {
+									boxMask |= 1u << (dx + dy * BLOCK_WIDTH);
+								}
+							}
+						}
+						boxMask &= rowMask;
+
+						int64_t blockW[3]{};
+						for (int e{}; e < 3; ++e) {
+							blockW[e] = coarseW[e] + stepX[e] * (bx - cx) + stepY[e] * (by - cy);
+						}
+
+						// Blocks inside a fully covered coarse block skip the coverage test
+						uint32_t coverageMask{ boxMask };
+						if (!isInside) {
+							for (int e{}; e < 3; ++e) {
+								blockEdges.origin[e] = SaturateEdge(blockW[e]);
+							}
+							coverageMask &= m_CoverageFunction(blockEdges);
+						}
+
+						// Only the covered pixels go through the depth test, the ones that pass get shaded per quad after that
+						uint32_t shadeMask{};
+						while (coverageMask != 0) {
+							const int i{ std::countr_zero(coverageMask) };
+							coverageMask &= coverageMask - 1;
+
+							const int dx{ i % BLOCK_WIDTH };
+							const int dy{ i / BLOCK_WIDTH };
+
+							if constexpr (pass == RasterPass::depthEqual) {
+								shadeMask |= uint32_t(DepthEqualPixel<State>(triangle, bx + dx, by + dy)) << i;
+							}
+							else {
+								const bool depthTestPassed{ pass == RasterPass::depthOnly ?
+									DepthOnlyPixel<State>(triangle, bx + dx, by + dy, isInFront) :
+									DepthTestPixel<State>(triangle, bx + dx, by + dy, isInFront) };
+								++stats.testCount;
+								stats.failCount += !depthTestPassed;
+								shadeMask |= uint32_t(depthTestPassed) << i;
+							}
+						}
+
+						// The 4x2 block is two 2x2 quads, the visibility buffer shades later when the tile is resolved
+						if constexpr (pass != RasterPass::depthOnly && !State::useVisibilityBuffer) {
+							for (int q{ 0 }; q < BLOCK_WIDTH / 2; ++q) {
+								const uint32_t laneMask{ ((shadeMask >> (2 * q)) & 3) | (((shadeMask >> (BLOCK_WIDTH + 2 * q)) & 3) << 2) };
+								if (laneMask != 0) {
+									ShadeQuad<State>(triangle, bx + 2 * q, by, laneMask);
+								}
+							}
 						}
 					}
 				}
 			}
+
+			for (int e{}; e < 3; ++e) {
+				coarseW[e] += stepX[e] * COARSE_BLOCK_SIZE;
+			}
+		}
+
+		for (int e{}; e < 3; ++e) {
+			rowW[e] += stepY[e] * COARSE_BLOCK_SIZE;
 		}
 	}
+
+	return hasLoweredMaxDepth;
 }
 
-ColorRGB Renderer::PixelShading(const Vertex_Out& v) {
-	
-	const Vector3 lightDirection{ 0.577f, -0.577f, 0.577f };
-	const float lightIntensity{ 7.0f };
-	const float shininess{ 25.0f };
-	ColorRGB finalColor{ 0,0,0 };
-	ColorRGB ambientColor{ 0.025f, 0.025f, 0.025f };
+template<typename State>
+bool Renderer::DepthTestPixel(const Triangle& triangle, int px, int py, bool isInFront) const {
+
+	// Pixel center relative to the plane origin
+	const float x{ float(px) - triangle.planeOriginX };
+	const float y{ float(py) - triangle.planeOriginY };
+
+	float interpolatedDepth{ triangle.depth.Evaluate(x, y) };
+	const typename State::Depth::Type encodedDepth{ State::Depth::Encode(interpolatedDepth) };
+	bool depthTestPassed{ isInFront || State::Depth::IsCloser(encodedDepth, m_pDepthBufferPixels[px + (py * m_Width)]) };
 
-	Vector3 sampledNomal{ v.normal };
+	if (depthTestPassed) {
 
-	// Normal map calculations
-	if (m_UseNormalMap) {
-		Vector3 binormal{ Vector3::Cross(v.normal, v.tangent) };
-		Matrix tangentSpaceAxis{ Matrix{v.tangent, binormal, v.normal, Vector3::Zero} };
+		// Update Depth Buffer
+		m_pDepthBufferPixels[px + (py * m_Width)] = encodedDepth;
 
-		ColorRGB normalColor{ m_pNormalMap->Sample(v.uv) };
-		sampledNomal = {normalColor.r, normalColor.g, normalColor.b };
-		sampledNomal = (2.0f * sampledNomal) - Vector3{ 1.0f, 1.0f, 1.0f };
-		sampledNomal = tangentSpaceAxis.TransformVector(sampledNomal);
+		// Deferred, only remember which triangle won, the tile gets shaded once all of its triangles are rasterized
+		if constexpr (State::useVisibilityBuffer) {
+			m_pVisibilityBufferPixels[px + (py * m_Width)] = uint32_t(&triangle - m_pTriangles);
+		}
 	}
 
-	// Cosine law
-	float observedArea{Vector3::Dot(sampledNomal, -lightDirection)};
+	return depthTestPassed;
+}
+
+template<typename State>
+bool Renderer::DepthOnlyPixel(const Triangle& triangle, int px, int py, bool isInFront) const {
 
-	if (observedArea > 0) {
+	// No varyings at all, just the depth plane
+	const float depth{ triangle.depth.Evaluate(float(px) - triangle.planeOriginX, float(py) - triangle.planeOriginY) };
+	const typename State::Depth::Type encodedDepth{ State::Depth::Encode(depth) };
+
+	typename State::Depth::Type& depthBuffer{ m_pDepthBufferPixels[px + (py * m_Width)] };
+	if (isInFront || State::Depth::IsCloser(encodedDepth, depthBuffer)) {
+		depthBuffer = encodedDepth;
+		return true;
+	}
+	return false;
+}
 
-		// Diffuse lambert color
-		ColorRGB diffuseColor = lightIntensity * m_pDiffuseColor->Sample(v.uv) / PI;
+template<typename State>
+bool Renderer::DepthEqualPixel(const Triangle& triangle, int px, int py) const {
 
-		// Specular Color
-		const ColorRGB ks{ m_pSpecularMap->Sample(v.uv) };
-		const float exp{ m_pGlossyMap->Sample(v.uv).r * shininess };
+	// Both passes evaluate the same plane the same way, so the winning fragment matches exactly
+	const float depth{ triangle.depth.Evaluate(float(px) - triangle.planeOriginX, float(py) - triangle.planeOriginY) };
+	if (State::Depth::Encode(depth) != m_pDepthBufferPixels[px + (py * m_Width)]) {
+		return false;
+	}
 
-		float dotproduct{ std::max(Vector3::Dot(sampledNomal,-lightDirection),0.0f) };
-		Vector3 r{ (- lightDirection) - 2 * (dotproduct * sampledNomal)};
-		float cosine{ std::max(Vector3::Dot(r,v.viewDirection),0.0f) };
-		ColorRGB specularPhong{ ks * powf(cosine,exp) };
+	if constexpr (State::useVisibilityBuffer) {
+		m_pVisibilityBufferPixels[px + (py * m_Width)] = uint32_t(&triangle - m_pTriangles);
+	}
+	return true;
+}
 
-		// Final color
-		switch (m_RenderMode) {
-			case RenderMode::observerdArea:
-				finalColor = ColorRGB{ observedArea, observedArea,observedArea };
-				break;
+template<typename State>
+void Renderer::ShadeQuad(const Triangle& triangle, int quadX, int quadY, uint32_t laneMask) const {
 
-			case RenderMode::diffuse:
-				finalColor = diffuseColor * observedArea;
-				break;
+	// Lane i is pixel (quadX + i % 2, quadY + i / 2), only the lanes in laneMask get written
+	// Visualize the depth buffer
+	if constexpr (State::debugView == DebugView::depthBuffer) {
+		for (int lane{ 0 }; lane < 4; ++lane) {
+			if ((laneMask & (1u << lane)) == 0) {
+				continue;
+			}
 
-			case RenderMode::specular:
-				finalColor = specularPhong * observedArea;
-				break;
+			const int px{ quadX + (lane & 1) };
+			const int py{ quadY + (lane >> 1) };
+			const float depth{ triangle.depth.Evaluate(float(px) - triangle.planeOriginX, float(py) - triangle.planeOriginY) };
+			float depthColor{ Remap(depth, 0.997f, 1.0f) };
 
-			case RenderMode::combined:
-				finalColor = (diffuseColor + specularPhong + ambientColor) * observedArea;
-					break;
+			m_pBackBufferPixels[px + (py * m_Width)] = SDL_MapRGB(m_pBackBuffer->format,
+				static_cast<uint8_t>(depthColor * 255),
+				static_cast<uint8_t>(depthColor * 255),
+				static_cast<uint8_t>(depthColor * 255));
 		}
 	}
-	
-	return finalColor;
+	else {
+		// Every material is compiled into the kernel, the triangle picks which one shades it
+		State::Materials::Dispatch(triangle.material, [&]<typename Shader>() {
+			ShadeMaterialQuad<Shader>(triangle, quadX, quadY, laneMask);
+		});
+	}
+}
+
+template<Material Shader>
+void Renderer::ShadeMaterialQuad(const Triangle& triangle, int quadX, int quadY, uint32_t laneMask) const {
+
+	// Lane i is pixel (quadX + i % 2, quadY + i / 2), only the lanes in laneMask get written
+	// Setup laid the triangle's planes out for the attributes of its material, which in a shading state are Shader's
+	constexpr uint32_t attributes{ Shader::attributes };
+	constexpr uint32_t planeCount{ AttributePlaneCount(attributes) };
+	const AttributePlane* pPlanes{ m_pAttributePlanes + triangle.firstPlane };
+	const AttributePlane& oneOverW{ pPlanes[0] };
+	const AttributePlane* pUV{ pPlanes + AttributePlaneOffset(attributes, ATTRIBUTE_UV) };
+	const AttributePlane* pNormal{ pPlanes + AttributePlaneOffset(attributes, ATTRIBUTE_NORMAL) };
+	const AttributePlane* pTangent{ pPlanes + AttributePlaneOffset(attributes, ATTRIBUTE_TANGENT) };
+	const AttributePlane* pViewDirection{ pPlanes + AttributePlaneOffset(attributes, ATTRIBUTE_VIEW_DIRECTION) };
+
+	// The uv goes through all 4 lanes, the uncovered ones are helpers that only exist for the derivatives
+	Vector2 quadUV[4]{};
+	if constexpr ((attributes & ATTRIBUTE_UV) != 0) {
+		for (int lane{ 0 }; lane < 4; ++lane) {
+			const float x{ float(quadX + (lane & 1)) - triangle.planeOriginX };
+			const float y{ float(quadY + (lane >> 1)) - triangle.planeOriginY };
+			quadUV[lane] = Vector2{ pUV[0].Evaluate(x, y), pUV[1].Evaluate(x, y) } * (1.0f / oneOverW.Evaluate(x, y));
+		}
+	}
+
+	// Coarse derivatives, the whole quad shares one pair
+	const PixelDerivatives derivatives{ quadUV[1] - quadUV[0], quadUV[2] - quadUV[0] };
+
+	for (int lane{ 0 }; lane < 4; ++lane) {
+		if ((laneMask & (1u << lane)) == 0) {
+			continue;
+		}
+
+		const int px{ quadX + (lane & 1) };
+		const int py{ quadY + (lane >> 1) };
+
+		// Pixel center relative to the plane origin
+		const float x{ float(px) - triangle.planeOriginX };
+		const float y{ float(py) - triangle.planeOriginY };
+
+		// InterpolatedW, the only division left per pixel, a shader without attributes has no 1/w plane
+		float interpolatedW{ 1.0f };
+		if constexpr (planeCount != 0) {
+			interpolatedW = 1.0f / oneOverW.Evaluate(x, y);
+		}
+
+		// Perspective correct attributes, only the ones this material reads
+		VaryingVertex pixelVertex{};
+		pixelVertex.position = { float(px), float(py), triangle.depth.Evaluate(x, y), interpolatedW };
+		pixelVertex.uv = quadUV[lane];
 
+		if constexpr ((attributes & ATTRIBUTE_NORMAL) != 0) {
+			Vector3 InterpolatedNormal{ pNormal[0].Evaluate(x, y), pNormal[1].Evaluate(x, y), pNormal[2].Evaluate(x, y) };
+			pixelVertex.normal = (InterpolatedNormal * interpolatedW).Normalized();
+		}
+
+		if constexpr ((attributes & ATTRIBUTE_TANGENT) != 0) {
+			Vector3 InterpolatedTangent{ pTangent[0].Evaluate(x, y), pTangent[1].Evaluate(x, y), pTangent[2].Evaluate(x, y) };
+			pixelVertex.tangent = (InterpolatedTangent * interpolatedW).Normalized();
+		}
+
+		if constexpr ((attributes & ATTRIBUTE_VIEW_DIRECTION) != 0) {
+			Vector3 InterpolatedViewDirection{ pViewDirection[0].Evaluate(x, y), pViewDirection[1].Evaluate(x, y), pViewDirection[2].Evaluate(x, y) };
+			pixelVertex.viewDirection = (InterpolatedViewDirection * interpolatedW).Normalized();
+		}
+
+		// The varyings the material declared, the offsets are constants once the loop is unrolled
+		for (uint32_t i{ 0 }; i < MAX_VARYINGS; ++i) {
+			if ((attributes & (ATTRIBUTE_VARYING0 << i)) != 0) {
+				pixelVertex.varyings[i] = pPlanes[AttributePlaneOffset(attributes, ATTRIBUTE_VARYING0 << i)].Evaluate(x, y) * interpolatedW;
+			}
+		}
+
+		ColorRGB finalColor{ Shader::Shade(std::get<typename Shader::Constants>(m_ShaderConstants), pixelVertex, derivatives) };
+
+		//Update Color in Buffer
+		finalColor.MaxToOne();
+
+		m_pBackBufferPixels[px + (py * m_Width)] = SDL_MapRGB(m_pBackBuffer->format,
+			static_cast<uint8_t>(finalColor.r * 255),
+			static_cast<uint8_t>(finalColor.g * 255),
+			static_cast<uint8_t>(finalColor.b * 255));
+	}
 }
\ No newline at end of file
@@ -2,9 +2,15 @@
 
 #include <cstdint>
 #include <vector>
+#include <array>
+#include <tuple>
+#include <utility>
 
 #include "Camera.h"
 #include "DataTypes.h"
+#include "Coverage.h"
+#include "DepthFormat.h"
+#include "Shader.h"
 
 struct SDL_Window;
 struct SDL_Surface;
@@ -16,8 +22,35 @@ namespace dae
 	struct Vertex;
 	class Timer;
 	class Scene;
+	class ThreadPool;
+	class LinearAllocator;
 
-	enum class RenderMode{observerdArea, diffuse, specular, combined};
+	enum class RasterPass{forward, depthOnly, depthEqual};
+	enum class DebugView{none, depthBuffer, boundingBoxes};
+
+	// Every material a mesh can be drawn with, in the order of MaterialType
+	// The phong toggles pick the variant of the phong material the whole frame is drawn with
+	template<RenderMode mode, bool useNormalMap>
+	using MaterialVariants = MaterialList<PhongShader<mode, useNormalMap>, VertexColorShader>;
+
+	// Vertex shaders and constant blocks are the same in every variant, everything that doesn't shade uses this one
+	using Materials = MaterialVariants<RenderMode::combined, true>;
+	static_assert(Materials::count == size_t(MaterialType::VertexColor) + 1, "MaterialType is out of sync with the material list");
+
+	// Everything that changes what happens per pixel, the tile kernel is compiled once for every combination
+	// The depth format is a build time choice, so every kernel uses the same one
+	template<typename MaterialsType, DebugView view, bool visibilityBuffer>
+	struct RenderState
+	{
+		using Materials = MaterialsType;
+		static constexpr DebugView debugView{ view };
+		static constexpr bool useVisibilityBuffer{ visibilityBuffer };
+		using Depth = DepthFormat;
+
+		// The Vertex_Out attributes the shading of every material reads, the debug views only need the position
+		static constexpr std::array<uint32_t, Materials::count> materialAttributes{
+			view != DebugView::none ? std::array<uint32_t, Materials::count>{} : Materials::attributes };
+	};
 
 	class Renderer final
 	{
@@ -35,12 +68,27 @@ namespace dae
 
 		bool SaveBufferToImage() const;
 
+		// Peak bytes used in one frame by the frame arena and by the busiest worker arena
+		size_t GetFrameArenaHighWaterMark() const;
+		size_t GetWorkerArenaHighWaterMark() const;
+
+		// Heap fallbacks of all arenas during the last frame, 0 once the arenas have grown to fit the scene
+		size_t GetArenaOverflowCount() const;
+
+		// Fraction of the per-pixel depth tests of the last frame that failed, pixels rejected by Hi-Z never get that far
+		float GetDepthTestFailRate() const;
+
 		// Function keys
 		void ToggleMode();
 		void ToggleBoundingBoxes();
 		void ToggleDepthBuffer();
 		void ToggleRotation();
 		void ToggleNormalMap();
+		void ToggleLazyVertexShading();
+		void ToggleVisibilityBuffer();
+		void ToggleDepthPrePass();
+		void ToggleFrontToBackSorting();
+		void ToggleVertexColorMaterial();
 
 	private:
 		SDL_Window* m_pWindow{};
@@ -49,7 +97,26 @@ namespace dae
 		SDL_Surface* m_pBackBuffer{ nullptr };
 		uint32_t* m_pBackBufferPixels{};
 
-		float* m_pDepthBufferPixels{};
+		DepthFormat::Type* m_pDepthBufferPixels{};
+
+		// Index into m_pTriangles of the triangle that is visible in every pixel, only used in visibility buffer mode
+		uint32_t* m_pVisibilityBufferPixels{};
+		static constexpr uint32_t m_EmptyVisibility{ UINT32_MAX };
+
+		// Hi-Z, conservative nearest and farthest depth of every coarse block of the depth buffer
+		float* m_pHiZMinDepth{};
+		float* m_pHiZMaxDepth{};
+		int m_HiZWidth{};
+		int m_HiZHeight{};
+		// The depth a cleared pixel decodes to, for unorm formats that is the far plane, so fragments past it stay rejected
+		// by the fast path in a freshly cleared block just like the per-pixel test rejects them everywhere else
+		static constexpr float m_HiZClearDepth{ DepthFormat::Decode(DepthFormat::ClearValue) };
+
+		// Room for the rounding of the depth plane, so a bound is never on the wrong side of a pixel's depth
+		// Plus one step of the depth format, Hi-Z keeps float depths but the per-pixel test compares encoded ones,
+		// so a block only counts as in front when it can't encode to the same value as what is already there
+		static constexpr float m_DepthPlaneRounding{ 1e-6f };
+		static constexpr float m_HiZDepthMargin{ m_DepthPlaneRounding + DepthFormat::Quantum };
 
 		Camera m_Camera{};
 
@@ -59,6 +126,15 @@ namespace dae
 		//Functions that transforms the vertices from the mesh from World space to Screen space
 		void VertexTransformationFunction(const std::vector<Vertex>& vertices_in, std::vector<Vertex>& vertices_out) const; //W1 Version
 		void VertexTransformationFunction(Mesh& mesh) const; //W2 Version
+		VertexShaderContext GetVertexShaderContext(const Mesh& mesh) const;
+		template<VertexShader Shader>
+		void TransformVertexRange(Mesh& mesh, const VertexShaderContext& context, size_t begin, size_t end) const; //From the vertex streams if the shader can
+		void TransformVertexPosition(Mesh& mesh, const VertexShaderContext& context, uint32_t vertexIndex) const; //Lazy version, one vertex at a time
+		void TransformVertexAttributes(Mesh& mesh, const VertexShaderContext& context, uint32_t vertexIndex) const;
+		void PerspectiveDivide(Mesh& mesh) const; //Clip space to NDC for the W2 stages, RenderMeshes divides after clipping
+
+		// Vertices per job when the vertex stage is spread over the workers, a multiple of the SIMD batch size
+		static constexpr size_t m_VertexChunkSize{ 4096 };
 
 		// Textures
 		Texture* m_pDiffuseColor;
@@ -66,6 +142,9 @@ namespace dae
 		Texture* m_pSpecularMap;
 		Texture* m_pGlossyMap;
 
+		// Constant block of every material, a kernel finds its own through the type of its shader
+		Materials::Constants m_ShaderConstants{};
+
 		// W1 Render stages
 		void W1_Rasterization();
 		void W1_Perspective();
@@ -80,19 +159,144 @@ namespace dae
 
 		// Final Render loop
 		void RenderMeshes();
-		ColorRGB PixelShading(const Vertex_Out& v);
+		float GetDistanceToCamera(const Mesh& mesh, const Vector3& center, float radius) const;
+
+		// Tiled rasterization, every tile is owned by one worker so no locking is needed
+		static constexpr int m_TileSize{ 64 };
+
+		// Tile clears, the Hi-Z updates and the 2x2 quads all count on a coarse block never straddling two tiles
+		static_assert(m_TileSize % COARSE_BLOCK_SIZE == 0, "Tiles have to be made of whole coarse blocks");
+		int m_TileCountX{};
+		int m_TileCountY{};
+		ThreadPool* m_pThreadPool{ nullptr };
+
+		// Transient render data comes from the frame arena, which is reset at the start of Render
+		// Every worker thread also gets its own arena so they never contend on one
+		LinearAllocator* m_pFrameArena{ nullptr };
+		std::vector<LinearAllocator*> m_pWorkerArenas{};
+
+		// Debug builds assert that a frame past the warm-up never allocates from the heap
+		// The worker arenas are reserved for the largest bin every frame, so they never fall back to it
+		// The frame arena grows to 1.25x the largest frame it has seen, but its demand follows the view: triangles,
+		// attribute planes and bin entries, plus the buffers of the lazy and sorting toggles. So the check only holds
+		// for a view and settings that stay within that headroom, a camera that moves in on a much heavier view trips it
+		static constexpr uint32_t m_ArenaWarmUpFrames{ 4 };
+		uint32_t m_FramesSinceArenaWarmUp{};
+
+		// Triangle that survived culling, setup waits until the number of triangles out of the clipper is known
+		struct AssembledTriangle
+		{
+			Mesh* pMesh;
+			uint32_t index0, index1, index2;
+			bool needsClipping;
+		};
+
+		// Frustum planes a vertex is outside of, plus the guard band planes
+		static constexpr uint32_t m_OutCodeLeft{ 1 << 0 };
+		static constexpr uint32_t m_OutCodeRight{ 1 << 1 };
+		static constexpr uint32_t m_OutCodeBottom{ 1 << 2 };
+		static constexpr uint32_t m_OutCodeTop{ 1 << 3 };
+		static constexpr uint32_t m_OutCodeNear{ 1 << 4 };
+		static constexpr uint32_t m_OutCodeFar{ 1 << 5 };
+		static constexpr uint32_t m_OutCodeGuardLeft{ 1 << 6 };
+		static constexpr uint32_t m_OutCodeGuardRight{ 1 << 7 };
+		static constexpr uint32_t m_OutCodeGuardBottom{ 1 << 8 };
+		static constexpr uint32_t m_OutCodeGuardTop{ 1 << 9 };
+		static constexpr uint32_t m_FrustumOutCodes{ m_OutCodeLeft | m_OutCodeRight | m_OutCodeBottom | m_OutCodeTop | m_OutCodeNear | m_OutCodeFar };
+		static constexpr uint32_t m_ClipOutCodes{ m_OutCodeNear | m_OutCodeGuardLeft | m_OutCodeGuardRight | m_OutCodeGuardBottom | m_OutCodeGuardTop };
+
+		// Only the near plane is really clipped, x and y are left to the rasterizer as long as they stay in the guard band
+		// The band keeps the 28.4 coordinates small enough for the 32 bit edge steps of the coverage test
+		static constexpr int m_GuardBandSize{ 4096 };
+		static constexpr int m_MaxClipVertices{ 8 };
+		float m_GuardBandX{};
+		float m_GuardBandY{};
+
+		uint32_t ComputeOutCode(const Vector4& p) const;
+		int ClipTriangle(const VaryingVertex& v0, const VaryingVertex& v1, const VaryingVertex& v2, uint32_t varyingCount, VaryingVertex* pPolygon) const;
+		void AddTriangle(VaryingVertex v0, VaryingVertex v1, VaryingVertex v2, uint32_t material);
+
+		// Triangle setup records and the per tile bins (tile i owns m_pTileBinTriangles[m_pTileBinOffsets[i], m_pTileBinOffsets[i + 1]))
+		// A triangle's attribute planes start at its firstPlane, with as many as its material reads this frame
+		Triangle* m_pTriangles{ nullptr };
+		uint32_t m_TriangleCount{};
+		AttributePlane* m_pAttributePlanes{ nullptr };
+		uint32_t m_AttributePlaneCount{};
+		uint32_t* m_pTileBinOffsets{ nullptr };
+		uint32_t* m_pTileBinTriangles{ nullptr };
+		uint32_t m_LargestBinSize{};
+
+		// Per tile clear flags, a tile gets cleared by the first triangle that touches it instead of every frame up front
+		bool* m_pTileCleared{ nullptr };
+		uint32_t m_ClearColor{};
+
+		void ClearBuffers();
+		void ClearTile(int tileIndex, const Int2& tileMin, const Int2& tileMax) const;
+		void ResolveUntouchedTiles() const;
+
+		bool IsFaceCulled(const Vector4& p0, const Vector4& p1, const Vector4& p2, CullMode cullMode) const;
+		bool SetupTriangle(Triangle& triangle, AttributePlane* pPlanes, const VaryingVertex& v0, const VaryingVertex& v1, const VaryingVertex& v2) const;
+		void BinTriangles();
+		struct DepthTestStats
+		{
+			uint64_t testCount;
+			uint64_t failCount;
+		};
+		DepthTestStats m_DepthTestStats{};
+
+		template<typename State>
+		DepthTestStats RasterizeTile(int tileIndex, LinearAllocator& arena) const;
+		template<typename State, RasterPass pass>
+		bool RasterizeTriangle(const Triangle& triangle, const Int2& tileMin, const Int2& tileMax, DepthTestStats& stats) const; //Returns true when it lowered a Hi-Z max depth
+		template<typename State>
+		bool DepthTestPixel(const Triangle& triangle, int px, int py, bool isInFront) const; //All three return whether the pixel passed
+		template<typename State>
+		bool DepthOnlyPixel(const Triangle& triangle, int px, int py, bool isInFront) const;
+		template<typename State>
+		bool DepthEqualPixel(const Triangle& triangle, int px, int py) const;
+		template<typename State>
+		void ShadeQuad(const Triangle& triangle, int quadX, int quadY, uint32_t laneMask) const;
+		template<Material Shader>
+		void ShadeMaterialQuad(const Triangle& triangle, int quadX, int quadY, uint32_t laneMask) const;
+		template<typename State>
+		void ResolveVisibilityTile(const Int2& tileMin, const Int2& tileMax) const;
+
+		// One RasterizeTile per render state, GetTileKernel() picks the one matching the toggles
+		using TileKernel = DepthTestStats(Renderer::*)(int tileIndex, LinearAllocator& arena) const;
+		struct TileKernelEntry
+		{
+			TileKernel rasterizeTile;
+			std::array<uint32_t, Materials::count> materialAttributes;
+		};
+		static constexpr int m_TileKernelCount{ 48 };
+		template<size_t... indices>
+		static constexpr std::array<TileKernelEntry, sizeof...(indices)> MakeTileKernels(std::index_sequence<indices...>);
+		const TileKernelEntry& GetTileKernel() const;
+
+		// Attributes every material reads with the kernel picked for this frame, everything before rasterization only produces these
+		std::array<uint32_t, Materials::count> m_MaterialAttributes{ Materials::attributes };
+
+		// Block coverage test, picked at startup based on the cpu features
+		CoverageFunction m_CoverageFunction{ nullptr };
 
 		// Render modes
-		float Remap(float value, float min, float max);
+		float Remap(float value, float min, float max) const;
 		RenderMode m_RenderMode{ RenderMode::combined };
 		bool m_VisualizeBoundingBoxes{ false };
 		bool m_VisualizeDepthBuffer{ false };
 		bool m_DoRotation{ true };
 		bool m_UseNormalMap{ true };
+		bool m_LazyVertexShading{ false };
+		bool m_UseVisibilityBuffer{ false };
+		bool m_UseDepthPrePass{ false };
+		bool m_SortFrontToBack{ true };
 
 		// Tuktuk
 		Mesh* m_pObjectMesh = nullptr;
 		float m_Angle{ 0.0f };
 		float m_RotateSpeed{ 1 };
+
+		// Meshes drawn by RenderMeshes, not owned
+		std::vector<Mesh*> m_pMeshes{};
 	};
 }
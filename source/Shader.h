@@ -0,0 +1,349 @@
+#pragma once
+//Standard includes
+#include <concepts>
+#include <cstdint>
+#include <algorithm>
+#include <array>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <immintrin.h>
+
+//Project includes
+#include "Math.h"
+#include "DataTypes.h"
+#include "Texture.h"
+
+namespace dae
+{
+	// What the vertex stage hands a vertex shader for every vertex of one mesh
+	// attributes are the Vertex_Out attributes the mesh's material reads this frame, the others can be skipped
+	struct VertexShaderContext
+	{
+		Matrix worldViewProjection{};
+		Matrix world{};
+		Vector3 cameraOrigin{};
+		uint32_t attributes{};
+	};
+
+	// Object space vertex to clip space position and varyings, the perspective divide waits until after clipping
+	// Position and attributes are separate, so the lazy vertex stage can cull a triangle before it pays for the rest
+	// A shader can also have TransformRange(context, streams, begin, end, pVerticesOut), which the vertex stage
+	// then uses to transform whole chunks from the SoA vertex streams
+	// The varyings of a material come from TransformVaryings(context, vertex, pVaryings), as many as the material declares
+	template<typename T>
+	concept VertexShader = requires(const VertexShaderContext& context, const Vertex& vertex, Vertex_Out& vertexOut)
+	{
+		{ T::TransformPosition(context, vertex) } -> std::same_as<Vector4>;
+		{ T::TransformAttributes(context, vertex, vertexOut) } -> std::same_as<void>;
+	};
+
+	// Positions to clip space, normals and tangents to world space and the direction from the camera to the vertex
+	struct StandardVertexShader
+	{
+		static Vector4 TransformPosition(const VertexShaderContext& context, const Vertex& vertex)
+		{
+			return context.worldViewProjection.TransformPoint(vertex.position.x, vertex.position.y, vertex.position.z, 1.f);
+		}
+
+		static void TransformAttributes(const VertexShaderContext& context, const Vertex& vertex, Vertex_Out& vertexOut)
+		{
+			vertexOut.uv = vertex.uv;
+
+			// Transform normal and tangent To World space
+			if (context.attributes & ATTRIBUTE_NORMAL) {
+				vertexOut.normal = context.world.TransformVector(vertex.normal);
+			}
+			if (context.attributes & ATTRIBUTE_TANGENT) {
+				vertexOut.tangent = context.world.TransformVector(vertex.tangent);
+			}
+
+			// Calculate viewDirection
+			if (context.attributes & ATTRIBUTE_VIEW_DIRECTION) {
+				vertexOut.viewDirection = context.world.TransformPoint(vertex.position) - context.cameraOrigin;
+				vertexOut.viewDirection.Normalize();
+			}
+		}
+
+		// SIMD batches of 4 from the vertex streams
+		static void TransformRange(const VertexShaderContext& context, const VertexStreams& streams, size_t begin, size_t end, Vertex_Out* pVerticesOut)
+		{
+			// Every matrix element broadcasted over the 4 lanes
+			__m128 wvp[4][4]{};
+			__m128 world[4][4]{};
+			for (int r{ 0 }; r < 4; ++r) {
+				for (int c{ 0 }; c < 4; ++c) {
+					wvp[r][c] = _mm_set1_ps(context.worldViewProjection[r][c]);
+					world[r][c] = _mm_set1_ps(context.world[r][c]);
+				}
+			}
+			const __m128 originX{ _mm_set1_ps(context.cameraOrigin.x) };
+			const __m128 originY{ _mm_set1_ps(context.cameraOrigin.y) };
+			const __m128 originZ{ _mm_set1_ps(context.cameraOrigin.z) };
+
+			// Batches start at a multiple of 4, the streams are padded so the last batch can always be loaded
+			for (size_t first{ begin & ~size_t(3) }; first < end; first += 4) {
+
+				const __m128 x{ _mm_loadu_ps(&streams.positionX[first]) };
+				const __m128 y{ _mm_loadu_ps(&streams.positionY[first]) };
+				const __m128 z{ _mm_loadu_ps(&streams.positionZ[first]) };
+
+				// World to clip space, the perspective divide waits until after clipping
+				__m128 clip[4]{};
+				for (int c{ 0 }; c < 4; ++c) {
+					clip[c] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(wvp[0][c], x), _mm_mul_ps(wvp[1][c], y)), _mm_mul_ps(wvp[2][c], z)), wvp[3][c]);
+				}
+
+				// Transform normal and tangent To World space, only the attributes the material reads
+				__m128 normal[3]{}, tangent[3]{}, viewDirection[3]{};
+				if (context.attributes & ATTRIBUTE_NORMAL) {
+					const __m128 nx{ _mm_loadu_ps(&streams.normalX[first]) };
+					const __m128 ny{ _mm_loadu_ps(&streams.normalY[first]) };
+					const __m128 nz{ _mm_loadu_ps(&streams.normalZ[first]) };
+					for (int c{ 0 }; c < 3; ++c) {
+						normal[c] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(world[0][c], nx), _mm_mul_ps(world[1][c], ny)), _mm_mul_ps(world[2][c], nz));
+					}
+				}
+
+				if (context.attributes & ATTRIBUTE_TANGENT) {
+					const __m128 tx{ _mm_loadu_ps(&streams.tangentX[first]) };
+					const __m128 ty{ _mm_loadu_ps(&streams.tangentY[first]) };
+					const __m128 tz{ _mm_loadu_ps(&streams.tangentZ[first]) };
+					for (int c{ 0 }; c < 3; ++c) {
+						tangent[c] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(world[0][c], tx), _mm_mul_ps(world[1][c], ty)), _mm_mul_ps(world[2][c], tz));
+					}
+				}
+
+				// Calculate viewDirection
+				if (context.attributes & ATTRIBUTE_VIEW_DIRECTION) {
+					for (int c{ 0 }; c < 3; ++c) {
+						viewDirection[c] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(world[0][c], x), _mm_mul_ps(world[1][c], y)), _mm_mul_ps(world[2][c], z)), world[3][c]);
+					}
+					viewDirection[0] = _mm_sub_ps(viewDirection[0], originX);
+					viewDirection[1] = _mm_sub_ps(viewDirection[1], originY);
+					viewDirection[2] = _mm_sub_ps(viewDirection[2], originZ);
+					const __m128 length{ _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(viewDirection[0], viewDirection[0]),
+						_mm_mul_ps(viewDirection[1], viewDirection[1])), _mm_mul_ps(viewDirection[2], viewDirection[2]))) };
+					for (int c{ 0 }; c < 3; ++c) {
+						viewDirection[c] = _mm_div_ps(viewDirection[c], length);
+					}
+				}
+
+				// Back to one Vertex_Out per vertex
+				alignas(16) float lanes[16][4]{};
+				for (int c{ 0 }; c < 4; ++c) {
+					_mm_store_ps(lanes[c], clip[c]);
+				}
+				for (int c{ 0 }; c < 3; ++c) {
+					_mm_store_ps(lanes[4 + c], normal[c]);
+					_mm_store_ps(lanes[7 + c], tangent[c]);
+					_mm_store_ps(lanes[10 + c], viewDirection[c]);
+				}
+
+				const size_t laneBegin{ std::max(first, begin) - first };
+				const size_t laneEnd{ std::min(first + 4, end) - first };
+				for (size_t lane{ laneBegin }; lane < laneEnd; ++lane) {
+					const size_t vertexIndex{ first + lane };
+
+					Vertex_Out& vertexOut{ pVerticesOut[vertexIndex] };
+					vertexOut.position = { lanes[0][lane], lanes[1][lane], lanes[2][lane], lanes[3][lane] };
+					vertexOut.uv = { streams.u[vertexIndex], streams.v[vertexIndex] };
+					vertexOut.normal = { lanes[4][lane], lanes[5][lane], lanes[6][lane] };
+					vertexOut.tangent = { lanes[7][lane], lanes[8][lane], lanes[9][lane] };
+					vertexOut.viewDirection = { lanes[10][lane], lanes[11][lane], lanes[12][lane] };
+				}
+			}
+		}
+	};
+
+	// The pixel half of a material, the tile kernels get compiled for it so the shading inlines into the raster loop
+	// Constants is the material's constant block, its texture bindings and parameters, the renderer keeps one per type
+	// attributes declares the Vertex_Out attributes and varyings Shade reads, the vertex stage and triangle setup only produce those
+	// Pixels are shaded in 2x2 quads, so Shade also gets the screen space derivatives of the uv
+	template<typename T>
+	concept PixelShader = requires(const typename T::Constants& constants, const VaryingVertex& pixel, const PixelDerivatives& derivatives)
+	{
+		{ T::attributes } -> std::convertible_to<uint32_t>;
+		{ T::Shade(constants, pixel, derivatives) } -> std::same_as<ColorRGB>;
+	};
+
+	// What a mesh is drawn with, a pixel shader that names the vertex shader producing what it reads
+	template<typename T>
+	concept Material = PixelShader<T> && VertexShader<typename T::VertexShader>;
+
+	// std::tuple of the distinct types of Ts, in the order they first appear
+	template<typename Tuple, typename... Ts>
+	struct UniqueTupleBuilder
+	{
+		using type = Tuple;
+	};
+
+	template<typename... Us, typename T, typename... Ts>
+	struct UniqueTupleBuilder<std::tuple<Us...>, T, Ts...>
+	{
+		using type = typename std::conditional_t<(std::same_as<T, Us> || ...),
+			UniqueTupleBuilder<std::tuple<Us...>, Ts...>, UniqueTupleBuilder<std::tuple<Us..., T>, Ts...>>::type;
+	};
+
+	template<typename... Ts>
+	using UniqueTuple = typename UniqueTupleBuilder<std::tuple<>, Ts...>::type;
+
+	// The materials a mesh can pick from, MaterialType is an index into the list
+	// Every tile kernel is compiled with all of them and picks one per triangle
+	template<Material... Ts>
+	struct MaterialList
+	{
+		static constexpr size_t count{ sizeof...(Ts) };
+
+		template<size_t index>
+		using At = std::tuple_element_t<index, std::tuple<Ts...>>;
+
+		// One constant block per distinct Constants type, materials with the same type share it
+		using Constants = UniqueTuple<typename Ts::Constants...>;
+
+		// What the pixel shader of every material reads, in list order
+		static constexpr std::array<uint32_t, count> attributes{ Ts::attributes... };
+
+		// Calls function.template operator()<Material>() with the material at index
+		template<typename Function>
+		static void Dispatch(uint32_t index, Function&& function)
+		{
+			[&]<size_t... indices>(std::index_sequence<indices...>) {
+				((index == indices ? (function.template operator()<At<indices>>(), true) : false) || ...);
+			}(std::make_index_sequence<count>{});
+		}
+	};
+
+	enum class RenderMode{observerdArea, diffuse, specular, combined};
+
+	struct PhongConstants
+	{
+		const Texture* pDiffuseMap{ nullptr };
+		const Texture* pNormalMap{ nullptr };
+		const Texture* pSpecularMap{ nullptr };
+		const Texture* pGlossyMap{ nullptr };
+
+		Vector3 lightDirection{ 0.577f, -0.577f, 0.577f };
+		float lightIntensity{ 7.0f };
+		float shininess{ 25.0f };
+		ColorRGB ambientColor{ 0.025f, 0.025f, 0.025f };
+	};
+
+	// One directional light with lambert diffuse and phong specular, mode picks which terms end up in the output
+	template<RenderMode mode, bool useNormalMap>
+	struct PhongShader
+	{
+		using Constants = PhongConstants;
+		using VertexShader = StandardVertexShader;
+
+		static constexpr uint32_t attributes{
+			ATTRIBUTE_NORMAL |
+			(useNormalMap ? ATTRIBUTE_UV | ATTRIBUTE_TANGENT : 0) |
+			(mode != RenderMode::observerdArea ? ATTRIBUTE_UV : 0) |
+			(mode == RenderMode::specular || mode == RenderMode::combined ? ATTRIBUTE_VIEW_DIRECTION : 0) };
+
+		static ColorRGB Shade(const Constants& constants, const Vertex_Out& v, const PixelDerivatives& derivatives)
+		{
+			const Vector3& lightDirection{ constants.lightDirection };
+			ColorRGB finalColor{ 0,0,0 };
+
+			Vector3 sampledNomal{ v.normal };
+
+			// Normal map calculations
+			if constexpr (useNormalMap) {
+				Vector3 binormal{ Vector3::Cross(v.normal, v.tangent) };
+				Matrix tangentSpaceAxis{ Matrix{v.tangent, binormal, v.normal, Vector3::Zero} };
+
+				ColorRGB normalColor{ constants.pNormalMap->Sample(v.uv, derivatives.uvDdx, derivatives.uvDdy) };
+				sampledNomal = {normalColor.r, normalColor.g, normalColor.b };
+				sampledNomal = (2.0f * sampledNomal) - Vector3{ 1.0f, 1.0f, 1.0f };
+				sampledNomal = tangentSpaceAxis.TransformVector(sampledNomal);
+			}
+
+			// Cosine law
+			float observedArea{Vector3::Dot(sampledNomal, -lightDirection)};
+
+			if (observedArea > 0) {
+
+				// Only what the render mode shows gets computed
+				constexpr bool needsDiffuse{ mode == RenderMode::diffuse || mode == RenderMode::combined };
+				constexpr bool needsSpecular{ mode == RenderMode::specular || mode == RenderMode::combined };
+
+				// Diffuse lambert color
+				ColorRGB diffuseColor{};
+				if constexpr (needsDiffuse) {
+					diffuseColor = constants.lightIntensity * constants.pDiffuseMap->Sample(v.uv, derivatives.uvDdx, derivatives.uvDdy) / PI;
+				}
+
+				// Specular Color
+				ColorRGB specularPhong{};
+				if constexpr (needsSpecular) {
+					const ColorRGB ks{ constants.pSpecularMap->Sample(v.uv, derivatives.uvDdx, derivatives.uvDdy) };
+					const float exp{ constants.pGlossyMap->Sample(v.uv, derivatives.uvDdx, derivatives.uvDdy).r * constants.shininess };
+
+					float dotproduct{ std::max(Vector3::Dot(sampledNomal,-lightDirection),0.0f) };
+					Vector3 r{ (- lightDirection) - 2 * (dotproduct * sampledNomal)};
+					float cosine{ std::max(Vector3::Dot(r,v.viewDirection),0.0f) };
+					specularPhong = ks * powf(cosine,exp);
+				}
+
+				// Final color
+				if constexpr (mode == RenderMode::observerdArea) {
+					finalColor = ColorRGB{ observedArea, observedArea,observedArea };
+				}
+				else if constexpr (mode == RenderMode::diffuse) {
+					finalColor = diffuseColor * observedArea;
+				}
+				else if constexpr (mode == RenderMode::specular) {
+					finalColor = specularPhong * observedArea;
+				}
+				else {
+					finalColor = (diffuseColor + specularPhong + constants.ambientColor) * observedArea;
+				}
+			}
+
+			return finalColor;
+		}
+	};
+
+	struct VertexColorConstants
+	{
+		Vector3 lightDirection{ 0.577f, -0.577f, 0.577f };
+		ColorRGB ambientColor{ 0.025f, 0.025f, 0.025f };
+	};
+
+	// Lambert lit vertex color, the color reaches the pixels in three varyings
+	struct VertexColorShader
+	{
+		using Constants = VertexColorConstants;
+
+		struct VertexShader
+		{
+			static Vector4 TransformPosition(const VertexShaderContext& context, const Vertex& vertex)
+			{
+				return StandardVertexShader::TransformPosition(context, vertex);
+			}
+
+			static void TransformAttributes(const VertexShaderContext& context, const Vertex& vertex, Vertex_Out& vertexOut)
+			{
+				StandardVertexShader::TransformAttributes(context, vertex, vertexOut);
+			}
+
+			static void TransformVaryings(const VertexShaderContext&, const Vertex& vertex, float* pVaryings)
+			{
+				pVaryings[0] = vertex.color.r;
+				pVaryings[1] = vertex.color.g;
+				pVaryings[2] = vertex.color.b;
+			}
+		};
+
+		static constexpr uint32_t attributes{ ATTRIBUTE_NORMAL | AttributeVaryings(3) };
+
+		static ColorRGB Shade(const Constants& constants, const VaryingVertex& v, const PixelDerivatives&)
+		{
+			const ColorRGB color{ v.varyings[0], v.varyings[1], v.varyings[2] };
+			const float observedArea{ std::max(Vector3::Dot(v.normal, -constants.lightDirection), 0.0f) };
+			return (color + constants.ambientColor) * observedArea;
+		}
+	};
+}
@@ -1,6 +1,9 @@
 #include "Texture.h"
 #include "Vector2.h"
+#include "ThreadPool.h"
 #include <SDL_image.h>
+#include <algorithm>
+#include <cmath>
 
 namespace dae
 {
@@ -19,21 +22,112 @@ namespace dae
 		}
 	}
 
-	Texture* Texture::LoadFromFile(const std::string& path)
+	Texture* Texture::LoadFromFile(const std::string& path, ThreadPool* pThreadPool)
 	{
 		//TODO
 		//Load SDL_Surface using IMG_LOAD
 		//Create & Return a new Texture Object (using SDL_Surface)
 		SDL_Surface* surface = IMG_Load(path.c_str());
-		return new Texture(surface);
+		Texture* pTexture{ new Texture(surface) };
+		pTexture->GenerateMipLevels(pThreadPool);
+		return pTexture;
+	}
+
+	void Texture::GenerateMipLevels(ThreadPool* pThreadPool)
+	{
+		m_MipLevels.push_back({ m_pSurfacePixels, m_pSurface->w, m_pSurface->h });
+
+		// Every level halves the size down to 1x1, they all go in one allocation so the level pointers stay valid
+		size_t mipPixelCount{};
+		for (int width{ m_pSurface->w }, height{ m_pSurface->h }; width > 1 || height > 1;) {
+			width = std::max(width / 2, 1);
+			height = std::max(height / 2, 1);
+			mipPixelCount += size_t(width) * height;
+		}
+		m_MipPixels.resize(mipPixelCount);
+
+		uint32_t* pNextPixels{ m_MipPixels.data() };
+		while (m_MipLevels.back().width > 1 || m_MipLevels.back().height > 1) {
+
+			const MipLevel source{ m_MipLevels.back() };
+			const MipLevel level{ pNextPixels, std::max(source.width / 2, 1), std::max(source.height / 2, 1) };
+			uint32_t* pDestination{ pNextPixels };
+
+			// Box filter, every texel averages the 2x2 texels below it, the last row or column repeats on odd sizes
+			const auto filterRow = [&](uint32_t y, uint32_t) {
+				const int y0{ std::min(int(y) * 2, source.height - 1) };
+				const int y1{ std::min(int(y) * 2 + 1, source.height - 1) };
+
+				for (int x{ 0 }; x < level.width; ++x) {
+					const int x0{ std::min(x * 2, source.width - 1) };
+					const int x1{ std::min(x * 2 + 1, source.width - 1) };
+
+					uint32_t sum[3]{};
+					for (const uint32_t texel : { source.pPixels[x0 + y0 * source.width], source.pPixels[x1 + y0 * source.width],
+						source.pPixels[x0 + y1 * source.width], source.pPixels[x1 + y1 * source.width] })
+					{
+						Uint8 r{}, g{}, b{};
+						SDL_GetRGB(texel, m_pSurface->format, &r, &g, &b);
+						sum[0] += r;
+						sum[1] += g;
+						sum[2] += b;
+					}
+
+					pDestination[x + int(y) * level.width] = SDL_MapRGB(m_pSurface->format,
+						Uint8((sum[0] + 2) / 4), Uint8((sum[1] + 2) / 4), Uint8((sum[2] + 2) / 4));
+				}
+			};
+
+			// Rows of one level are independent, the levels themselves have to go one after the other
+			if (pThreadPool) {
+				pThreadPool->ParallelFor(uint32_t(level.height), filterRow);
+			}
+			else {
+				for (uint32_t y{ 0 }; y < uint32_t(level.height); ++y) {
+					filterRow(y, 0);
+				}
+			}
+
+			m_MipLevels.push_back(level);
+			pNextPixels += size_t(level.width) * level.height;
+		}
 	}
 
 	ColorRGB Texture::Sample(const Vector2& uv) const
+	{
+		return SampleLevel(uv, 0);
+	}
+
+	ColorRGB Texture::Sample(const Vector2& uv, const Vector2& uvDdx, const Vector2& uvDdy) const
+	{
+		// Squared length of one pixel step in level 0 texels, along the screen axis where the texture shrinks the most
+		const float width{ float(m_pSurface->w) };
+		const float height{ float(m_pSurface->h) };
+		const float lengthX{ (uvDdx.x * width) * (uvDdx.x * width) + (uvDdx.y * height) * (uvDdx.y * height) };
+		const float lengthY{ (uvDdy.x * width) * (uvDdy.x * width) + (uvDdy.y * height) * (uvDdy.y * height) };
+
+		// A helper lane far outside a sliver can have 1/w near 0 and an inf or NaN uv, the footprint then says nothing
+		// about the covered pixels of the quad, so they get level 0 instead of all ending up on the 1x1 level
+		if (!std::isfinite(lengthX) || !std::isfinite(lengthY)) {
+			return SampleLevel(uv, 0);
+		}
+
+		// log2 of the footprint, half the log2 of the squared length saves the square root
+		// A pixel smaller than a texel stays on level 0, otherwise the nearest level is used
+		const float lod{ 0.5f * std::log2(std::max(std::max(lengthX, lengthY), 1.f)) + 0.5f };
+		const int lastLevel{ int(m_MipLevels.size()) - 1 };
+		const int level{ lod < float(lastLevel) ? int(lod) : lastLevel };
+
+		return SampleLevel(uv, level);
+	}
+
+	ColorRGB Texture::SampleLevel(const Vector2& uv, int level) const
 	{
 		//TODO
 		//Sample the correct texel for the given uv
-		int width = m_pSurface->w;
-		int height = m_pSurface->h;
+		const MipLevel& mipLevel{ m_MipLevels[level] };
+		int width = mipLevel.width;
+		int height = mipLevel.height;
 
 		int px{ int(uv.x * (width - 1)) % width };
 		int py{ int(uv.y * (height - 1)) % height };
@@ -47,7 +141,7 @@ namespace dae
 		}
 
 		Uint8 r{}, g{}, b{};
-		SDL_GetRGB(m_pSurfacePixels[px + py * width], m_pSurface->format, &r, &g, &b);
+		SDL_GetRGB(mipLevel.pPixels[px + py * width], m_pSurface->format, &r, &g, &b);
 		ColorRGB sampledColor{ r,g,b };
 
 		return (sampledColor / 255.0f);
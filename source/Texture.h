@@ -1,24 +1,43 @@
 #pragma once
 #include <SDL_surface.h>
 #include <string>
+#include <vector>
 #include "ColorRGB.h"
 
 namespace dae
 {
 	struct Vector2;
+	class ThreadPool;
 
 	class Texture
 	{
 	public:
 		~Texture();
 
-		static Texture* LoadFromFile(const std::string& path);
+		// Builds the mip chain right away, spread over the pool's threads when there is one
+		static Texture* LoadFromFile(const std::string& path, ThreadPool* pThreadPool = nullptr);
 		ColorRGB Sample(const Vector2& uv) const;
 
+		// Samples the mip level whose texels are closest to one pixel, uvDdx and uvDdy are the uv change per pixel
+		ColorRGB Sample(const Vector2& uv, const Vector2& uvDdx, const Vector2& uvDdy) const;
+
 	private:
 		Texture(SDL_Surface* pSurface);
 
+		void GenerateMipLevels(ThreadPool* pThreadPool);
+		ColorRGB SampleLevel(const Vector2& uv, int level) const;
+
 		SDL_Surface* m_pSurface{ nullptr };
 		uint32_t* m_pSurfacePixels{ nullptr };
+
+		// Level 0 is the surface itself, the smaller levels share one buffer in the surface's pixel format
+		struct MipLevel
+		{
+			const uint32_t* pPixels;
+			int width;
+			int height;
+		};
+		std::vector<MipLevel> m_MipLevels{};
+		std::vector<uint32_t> m_MipPixels{};
 	};
 }
\ No newline at end of file
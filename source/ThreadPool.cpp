@@ -0,0 +1,99 @@
+#include "ThreadPool.h"
+
+//Standard includes
+#include <algorithm>
+
+using namespace dae;
+
+ThreadPool::ThreadPool(uint32_t threadCount)
+{
+	if (threadCount == 0) {
+		threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+
+	// The thread calling ParallelFor also does work, so spawn one less
+	m_Workers.reserve(threadCount - 1);
+	for (uint32_t i{ 1 }; i < threadCount; ++i) {
+		m_Workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard lock{ m_Mutex };
+		m_IsStopping = true;
+	}
+	m_WakeCondition.notify_all();
+
+	for (std::thread& worker : m_Workers) {
+		worker.join();
+	}
+}
+
+void ThreadPool::Run(uint32_t count, const void* pJob, JobInvoker invoke)
+{
+	if (count == 0) {
+		return;
+	}
+
+	// Not worth waking anyone up
+	if (m_Workers.empty() || count == 1) {
+		for (uint32_t i{}; i < count; ++i) {
+			invoke(pJob, i, 0);
+		}
+		return;
+	}
+
+	{
+		std::lock_guard lock{ m_Mutex };
+		m_pJob = pJob;
+		m_Invoke = invoke;
+		m_JobCount = count;
+		m_NextIndex = 0;
+		m_BusyWorkers = uint32_t(m_Workers.size());
+		++m_Generation;
+	}
+	m_WakeCondition.notify_all();
+
+	RunJobs(0);
+
+	// Wait for the workers to finish their last job
+	std::unique_lock lock{ m_Mutex };
+	m_DoneCondition.wait(lock, [this] { return m_BusyWorkers == 0; });
+	m_pJob = nullptr;
+	m_Invoke = nullptr;
+}
+
+void ThreadPool::WorkerLoop(uint32_t threadIndex)
+{
+	uint64_t seenGeneration{};
+
+	while (true) {
+		{
+			std::unique_lock lock{ m_Mutex };
+			m_WakeCondition.wait(lock, [&] { return m_IsStopping || m_Generation != seenGeneration; });
+
+			if (m_IsStopping) {
+				return;
+			}
+			seenGeneration = m_Generation;
+		}
+
+		RunJobs(threadIndex);
+
+		{
+			std::lock_guard lock{ m_Mutex };
+			--m_BusyWorkers;
+		}
+		m_DoneCondition.notify_one();
+	}
+}
+
+void ThreadPool::RunJobs(uint32_t threadIndex)
+{
+	// Grab indices until the job is exhausted
+	for (uint32_t index{ m_NextIndex++ }; index < m_JobCount; index = m_NextIndex++) {
+		m_Invoke(m_pJob, index, threadIndex);
+	}
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+//Standard includes
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dae
+{
+	class ThreadPool final
+	{
+	public:
+		// threadCount of 0 uses all hardware threads (the calling thread counts as one of them)
+		explicit ThreadPool(uint32_t threadCount = 0);
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool(ThreadPool&&) noexcept = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+		ThreadPool& operator=(ThreadPool&&) noexcept = delete;
+
+		// Runs job(index, threadIndex) for every index in [0, count) and blocks until all of them are done
+		// The calling thread helps out, so a pool without workers simply runs the loop inline
+		// The job is only referenced, never copied, so this doesn't allocate
+		template<typename Job>
+		void ParallelFor(uint32_t count, const Job& job)
+		{
+			Run(count, &job, [](const void* pJob, uint32_t index, uint32_t threadIndex) {
+				(*static_cast<const Job*>(pJob))(index, threadIndex);
+			});
+		}
+
+		uint32_t GetThreadCount() const { return uint32_t(m_Workers.size()) + 1; };
+
+	private:
+		using JobInvoker = void(*)(const void* pJob, uint32_t index, uint32_t threadIndex);
+
+		void Run(uint32_t count, const void* pJob, JobInvoker invoke);
+		void WorkerLoop(uint32_t threadIndex);
+		void RunJobs(uint32_t threadIndex);
+
+		std::vector<std::thread> m_Workers{};
+
+		std::mutex m_Mutex{};
+		std::condition_variable m_WakeCondition{};
+		std::condition_variable m_DoneCondition{};
+
+		const void* m_pJob{ nullptr };
+		JobInvoker m_Invoke{ nullptr };
+		uint32_t m_JobCount{};
+		std::atomic<uint32_t> m_NextIndex{};
+		uint32_t m_BusyWorkers{};
+		uint64_t m_Generation{};
+		bool m_IsStopping{ false };
+	};
+}
@@ -1,6 +1,8 @@
 #pragma once
 #include <cassert>
 #include <fstream>
+#include <unordered_map>
+#include <algorithm>
 #include "Math.h"
 #include "DataTypes.h"
 
@@ -10,7 +12,28 @@ namespace dae
 {
 	namespace Utils
 	{
-		//Just parses vertices and indices
+		//Key of a face corner in the OBJ index space, used to weld identical corners
+		struct ObjIndexKey
+		{
+			uint32_t iPosition{};
+			uint32_t iTexCoord{};
+			uint32_t iNormal{};
+
+			bool operator==(const ObjIndexKey&) const = default;
+		};
+
+		struct ObjIndexKeyHash
+		{
+			size_t operator()(const ObjIndexKey& key) const
+			{
+				size_t hash = std::hash<uint32_t>{}(key.iPosition);
+				hash ^= std::hash<uint32_t>{}(key.iTexCoord) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+				hash ^= std::hash<uint32_t>{}(key.iNormal) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+				return hash;
+			}
+		};
+
+		//Just parses vertices and indices, corners with the same position/uv/normal are welded into one vertex
 #pragma warning(push)
 #pragma warning(disable : 4505) //Warning unreferenced local function
 		static bool ParseOBJ(const std::string& filename, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, bool flipAxisAndWinding = true)
@@ -34,6 +57,8 @@ namespace dae
 			vertices.clear();
 			indices.clear();
 
+			std::unordered_map<ObjIndexKey, uint32_t, ObjIndexKeyHash> vertexLookup{};
+
 			std::string sCommand;
 			// start a while iteration ending when the end of file is reached (ios::eof)
 			while (!file.eof())
@@ -76,15 +101,12 @@ namespace dae
 					//add the material index as attibute to the attribute array
 					//
 					// Faces or triangles
-					Vertex vertex{};
-					size_t iPosition, iTexCoord, iNormal;
-
 					uint32_t tempIndices[3];
 					for (size_t iFace = 0; iFace < 3; iFace++)
 					{
-						// OBJ format uses 1-based arrays
-						file >> iPosition;
-						vertex.position = positions[iPosition - 1];
+						// OBJ format uses 1-based arrays, 0 marks a missing texcoord/normal
+						ObjIndexKey key{};
+						file >> key.iPosition;
 
 						if ('/' == file.peek())//is next in buffer ==  '/' ?
 						{
@@ -93,8 +115,7 @@ namespace dae
 							if ('/' != file.peek())
 							{
 								// Optional texture coordinate
-								file >> iTexCoord;
-								vertex.uv = UVs[iTexCoord - 1];
+								file >> key.iTexCoord;
 							}
 
 							if ('/' == file.peek())
@@ -102,14 +123,24 @@ namespace dae
 								file.ignore();
 
 								// Optional vertex normal
-								file >> iNormal;
-								vertex.normal = normals[iNormal - 1];
+								file >> key.iNormal;
 							}
 						}
 
-						vertices.push_back(vertex);
-						tempIndices[iFace] = uint32_t(vertices.size()) - 1;
-						//indices.push_back(uint32_t(vertices.size()) - 1);
+						// Corners that share the same position/uv/normal triple share one vertex
+						const auto [it, isNew] = vertexLookup.try_emplace(key, uint32_t(vertices.size()));
+						if (isNew)
+						{
+							Vertex vertex{};
+							vertex.position = positions[key.iPosition - 1];
+							if (key.iTexCoord != 0)
+								vertex.uv = UVs[key.iTexCoord - 1];
+							if (key.iNormal != 0)
+								vertex.normal = normals[key.iNormal - 1];
+
+							vertices.push_back(vertex);
+						}
+						tempIndices[iFace] = it->second;
 					}
 
 					indices.push_back(tempIndices[0]);
@@ -146,7 +177,19 @@ namespace dae
 				const Vector3 edge1 = p2 - p0;
 				const Vector2 diffX = Vector2(uv1.x - uv0.x, uv2.x - uv0.x);
 				const Vector2 diffY = Vector2(uv1.y - uv0.y, uv2.y - uv0.y);
-				float r = 1.f / Vector2::Cross(diffX, diffY);
+
+				// Welded vertices accumulate every face around them, so one degenerate uv mapping
+				// would poison all of its neighbours with inf/nan
+				// Degenerate is relative to the uv edges, |cross| = |e0| * |e1| * sin(angle), so tiny but well shaped
+				// uv triangles of a finely tessellated mesh still count and only (nearly) collinear ones are skipped
+				const float uvArea = Vector2::Cross(diffX, diffY);
+				const float uvEdge0SqrLength = diffX.x * diffX.x + diffY.x * diffY.x;
+				const float uvEdge1SqrLength = diffX.y * diffX.y + diffY.y * diffY.y;
+				constexpr float minSqrSine = 1e-6f;
+				if (uvArea * uvArea <= minSqrSine * uvEdge0SqrLength * uvEdge1SqrLength)
+					continue;
+
+				float r = 1.f / uvArea;
 
 				Vector3 tangent = (edge0 * diffY.y - edge1 * diffY.x) * r;
 				vertices[index0].tangent += tangent;
@@ -157,7 +200,15 @@ namespace dae
 			//Fix the tangents per vertex now because we accumulated
 			for (auto& v : vertices)
 			{
-				v.tangent = Vector3::Reject(v.tangent, v.normal).Normalized();
+				v.tangent = Vector3::Reject(v.tangent, v.normal);
+
+				// Only degenerate or mirrored uv's around this vertex, any tangent in the surface will do
+				if (v.tangent.SqrMagnitude() <= FLT_EPSILON)
+				{
+					const Vector3& axis = std::abs(v.normal.x) < 0.9f ? Vector3::UnitX : Vector3::UnitY;
+					v.tangent = Vector3::Cross(axis, v.normal);
+				}
+				v.tangent.Normalize();
 
 				if(flipAxisAndWinding)
 				{
@@ -171,6 +222,267 @@ namespace dae
 			return true;
 #endif
 		}
+
+		//Reorders a triangle list for the post-transform vertex cache (Tipsify, Sander et al. 2007)
+		//Triangles keep their winding, only the order in which they are drawn changes
+		static void OptimizeVertexCache(std::vector<uint32_t>& indices, size_t vertexCount, int cacheSize = 16)
+		{
+			const size_t triangleCount = indices.size() / 3;
+			if (triangleCount == 0 || vertexCount == 0)
+				return;
+
+			// Triangles around every vertex, packed as offsets into one list
+			std::vector<uint32_t> adjacencyOffsets(vertexCount + 1, 0);
+			for (uint32_t index : indices)
+				++adjacencyOffsets[index + 1];
+			for (size_t v = 0; v < vertexCount; ++v)
+				adjacencyOffsets[v + 1] += adjacencyOffsets[v];
+
+			std::vector<uint32_t> liveTriangles(vertexCount, 0);
+			std::vector<uint32_t> adjacency(indices.size());
+			for (size_t i = 0; i < triangleCount * 3; ++i)
+			{
+				const uint32_t index = indices[i];
+				adjacency[adjacencyOffsets[index] + liveTriangles[index]++] = uint32_t(i / 3);
+			}
+
+			std::vector<int> cacheTime(vertexCount, 0);
+			std::vector<bool> emitted(triangleCount, false);
+			std::vector<uint32_t> deadEnd{};
+			std::vector<uint32_t> candidates{};
+			std::vector<uint32_t> output{};
+			output.reserve(triangleCount * 3);
+
+			int fanVertex = 0;
+			int time = cacheSize + 1;
+			size_t cursor = 1;
+
+			while (fanVertex >= 0)
+			{
+				// Emit every triangle around the fanning vertex that is still left
+				candidates.clear();
+				for (uint32_t a = adjacencyOffsets[fanVertex]; a < adjacencyOffsets[size_t(fanVertex) + 1]; ++a)
+				{
+					const uint32_t triangle = adjacency[a];
+					if (emitted[triangle])
+						continue;
+
+					for (size_t corner = 0; corner < 3; ++corner)
+					{
+						const uint32_t v = indices[size_t(triangle) * 3 + corner];
+						output.push_back(v);
+						deadEnd.push_back(v);
+						candidates.push_back(v);
+						--liveTriangles[v];
+
+						// Not in the cache anymore, so this corner loads it again
+						if (time - cacheTime[v] > cacheSize)
+							cacheTime[v] = time++;
+					}
+					emitted[triangle] = true;
+				}
+
+				// Next fan around the candidate that will still be in the cache after its triangles are emitted
+				fanVertex = -1;
+				int bestPriority = -1;
+				for (uint32_t v : candidates)
+				{
+					if (liveTriangles[v] == 0)
+						continue;
+
+					int priority = 0;
+					if (time - cacheTime[v] + 2 * int(liveTriangles[v]) <= cacheSize)
+						priority = time - cacheTime[v];
+
+					if (priority > bestPriority)
+					{
+						bestPriority = priority;
+						fanVertex = int(v);
+					}
+				}
+
+				// Dead end, go back to a recently used vertex or else the first vertex with triangles left
+				while (fanVertex < 0 && !deadEnd.empty())
+				{
+					const uint32_t v = deadEnd.back();
+					deadEnd.pop_back();
+					if (liveTriangles[v] > 0)
+						fanVertex = int(v);
+				}
+				while (fanVertex < 0 && cursor < vertexCount)
+				{
+					if (liveTriangles[cursor] > 0)
+						fanVertex = int(cursor);
+					++cursor;
+				}
+			}
+
+			indices.swap(output);
+		}
+
+		//Bounding sphere around the AABB center of the given vertices, or of the vertices the indices use
+		static void ComputeBoundingSphere(const std::vector<Vertex>& vertices, const uint32_t* pIndices, size_t indexCount, Vector3& center, float& radius)
+		{
+			Vector3 minimum{ FLT_MAX, FLT_MAX, FLT_MAX };
+			Vector3 maximum{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+			for (size_t i = 0; i < indexCount; ++i)
+			{
+				const Vector3& position = vertices[pIndices[i]].position;
+				minimum = { std::min(minimum.x, position.x), std::min(minimum.y, position.y), std::min(minimum.z, position.z) };
+				maximum = { std::max(maximum.x, position.x), std::max(maximum.y, position.y), std::max(maximum.z, position.z) };
+			}
+
+			center = (minimum + maximum) * 0.5f;
+			radius = 0.f;
+			for (size_t i = 0; i < indexCount; ++i)
+				radius = std::max(radius, (vertices[pIndices[i]].position - center).Magnitude());
+		}
+
+		//Sorts the triangles of a list along a Morton curve through their centroids and cuts them into meshlets
+		//Every meshlet is then reordered for the vertex cache on its own, so it stays one contiguous index range
+		static void BuildMeshlets(const std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, std::vector<Meshlet>& meshlets, size_t trianglesPerMeshlet = 256)
+		{
+			meshlets.clear();
+
+			const size_t triangleCount = indices.size() / 3;
+			if (triangleCount == 0)
+				return;
+
+			std::vector<Vector3> centroids(triangleCount);
+			Vector3 minimum{ FLT_MAX, FLT_MAX, FLT_MAX };
+			Vector3 maximum{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+			for (size_t t = 0; t < triangleCount; ++t)
+			{
+				centroids[t] = (vertices[indices[t * 3]].position + vertices[indices[t * 3 + 1]].position + vertices[indices[t * 3 + 2]].position) / 3.f;
+				minimum = { std::min(minimum.x, centroids[t].x), std::min(minimum.y, centroids[t].y), std::min(minimum.z, centroids[t].z) };
+				maximum = { std::max(maximum.x, centroids[t].x), std::max(maximum.y, centroids[t].y), std::max(maximum.z, centroids[t].z) };
+			}
+
+			// 10 bits per axis, interleaved
+			const auto spreadBits = [](uint32_t value) {
+				value = (value | (value << 16)) & 0x030000FF;
+				value = (value | (value << 8)) & 0x0300F00F;
+				value = (value | (value << 4)) & 0x030C30C3;
+				value = (value | (value << 2)) & 0x09249249;
+				return value;
+			};
+			const Vector3 extent = maximum - minimum;
+			const auto quantize = [](float value, float minValue, float range) {
+				return range > 0.f ? uint32_t(std::clamp((value - minValue) / range, 0.f, 1.f) * 1023.f) : 0u;
+			};
+
+			std::vector<std::pair<uint32_t, uint32_t>> order(triangleCount);
+			for (size_t t = 0; t < triangleCount; ++t)
+			{
+				const uint32_t x = quantize(centroids[t].x, minimum.x, extent.x);
+				const uint32_t y = quantize(centroids[t].y, minimum.y, extent.y);
+				const uint32_t z = quantize(centroids[t].z, minimum.z, extent.z);
+				order[t] = { spreadBits(x) | (spreadBits(y) << 1) | (spreadBits(z) << 2), uint32_t(t) };
+			}
+			std::sort(order.begin(), order.end());
+
+			std::vector<uint32_t> sorted{};
+			sorted.reserve(indices.size());
+			for (const auto& [code, triangle] : order)
+			{
+				sorted.push_back(indices[size_t(triangle) * 3]);
+				sorted.push_back(indices[size_t(triangle) * 3 + 1]);
+				sorted.push_back(indices[size_t(triangle) * 3 + 2]);
+			}
+
+			// Tipsify runs on meshlet local vertex indices, so its per vertex scratch is sized to the meshlet instead of the mesh
+			// localIndex is shared by all meshlets and only the entries a meshlet used get reset after it
+			std::vector<uint32_t> localIndex(vertices.size(), UINT32_MAX);
+			std::vector<uint32_t> localToGlobal{};
+			std::vector<uint32_t> meshletIndices{};
+			for (size_t first = 0; first < triangleCount; first += trianglesPerMeshlet)
+			{
+				const size_t count = std::min(trianglesPerMeshlet, triangleCount - first);
+				uint32_t* pMeshletIndices = sorted.data() + first * 3;
+
+				localToGlobal.clear();
+				meshletIndices.resize(count * 3);
+				for (size_t i = 0; i < count * 3; ++i)
+				{
+					const uint32_t index = pMeshletIndices[i];
+					if (localIndex[index] == UINT32_MAX)
+					{
+						localIndex[index] = uint32_t(localToGlobal.size());
+						localToGlobal.push_back(index);
+					}
+					meshletIndices[i] = localIndex[index];
+				}
+
+				OptimizeVertexCache(meshletIndices, localToGlobal.size());
+
+				for (size_t i = 0; i < count * 3; ++i)
+					pMeshletIndices[i] = localToGlobal[meshletIndices[i]];
+				for (uint32_t index : localToGlobal)
+					localIndex[index] = UINT32_MAX;
+
+				Meshlet meshlet{ uint32_t(first * 3), uint32_t(count * 3) };
+				ComputeBoundingSphere(vertices, pMeshletIndices, count * 3, meshlet.center, meshlet.radius);
+				meshlets.push_back(meshlet);
+			}
+
+			indices.swap(sorted);
+		}
+
+		//Reorders the vertices in the order the indices first use them so the vertex fetches walk through memory
+		//Vertices that no triangle uses are dropped
+		static void OptimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices)
+		{
+			std::vector<uint32_t> remap(vertices.size(), UINT32_MAX);
+			std::vector<Vertex> reordered{};
+			reordered.reserve(vertices.size());
+
+			for (uint32_t& index : indices)
+			{
+				if (remap[index] == UINT32_MAX)
+				{
+					remap[index] = uint32_t(reordered.size());
+					reordered.push_back(vertices[index]);
+				}
+				index = remap[index];
+			}
+
+			vertices.swap(reordered);
+		}
+
+		//Splits the vertices into one stream per component, padded to a multiple of 4 vertices
+		//The only place the streams get written, they are stamped with the vertex version they were built from
+		static void BuildVertexStreams(Mesh& mesh)
+		{
+			const std::vector<Vertex>& vertices{ mesh.vertices };
+			VertexStreams& streams{ mesh.vertexStreams };
+			const size_t paddedCount{ (vertices.size() + 3) & ~size_t(3) };
+			streams.count = vertices.size();
+			streams.version = mesh.vertexVersion;
+
+			for (std::vector<float>* pStream : { &streams.positionX, &streams.positionY, &streams.positionZ,
+				&streams.u, &streams.v,
+				&streams.normalX, &streams.normalY, &streams.normalZ,
+				&streams.tangentX, &streams.tangentY, &streams.tangentZ })
+			{
+				pStream->assign(paddedCount, 0.f);
+			}
+
+			for (size_t i = 0; i < vertices.size(); ++i)
+			{
+				const Vertex& vertex = vertices[i];
+				streams.positionX[i] = vertex.position.x;
+				streams.positionY[i] = vertex.position.y;
+				streams.positionZ[i] = vertex.position.z;
+				streams.u[i] = vertex.uv.x;
+				streams.v[i] = vertex.uv.y;
+				streams.normalX[i] = vertex.normal.x;
+				streams.normalY[i] = vertex.normal.y;
+				streams.normalZ[i] = vertex.normal.z;
+				streams.tangentX[i] = vertex.tangent.x;
+				streams.tangentY[i] = vertex.tangent.y;
+				streams.tangentZ[i] = vertex.tangent.z;
+			}
+		}
 #pragma warning(pop)
 	}
 }
\ No newline at end of file
@@ -84,6 +84,26 @@ int main(int argc, char* args[])
 					pRenderer->ToggleMode();
 				}
 
+				if (e.key.keysym.scancode == SDL_SCANCODE_F8) {
+					pRenderer->ToggleLazyVertexShading();
+				}
+
+				if (e.key.keysym.scancode == SDL_SCANCODE_F9) {
+					pRenderer->ToggleVisibilityBuffer();
+				}
+
+				if (e.key.keysym.scancode == SDL_SCANCODE_F10) {
+					pRenderer->ToggleDepthPrePass();
+				}
+
+				if (e.key.keysym.scancode == SDL_SCANCODE_F11) {
+					pRenderer->ToggleFrontToBackSorting();
+				}
+
+				if (e.key.keysym.scancode == SDL_SCANCODE_F2) {
+					pRenderer->ToggleVertexColorMaterial();
+				}
+
 				break;
 			}
 		}
@@ -101,6 +121,7 @@ int main(int argc, char* args[])
 		{
 			printTimer = 0.f;
 			std::cout << "dFPS: " << pTimer->GetdFPS() << std::endl;
+			std::cout << "Depth test fail rate: " << pRenderer->GetDepthTestFailRate() * 100.f << "%" << std::endl;
 		}
 
 		//Save screenshot after full render
@@ -115,6 +136,10 @@ int main(int argc, char* args[])
 	}
 	pTimer->Stop();
 
+	// Peak transient memory, to size the arenas for production scenes
+	std::cout << "Frame arena high-water mark: " << pRenderer->GetFrameArenaHighWaterMark() / 1024 << " KB" << std::endl;
+	std::cout << "Worker arena high-water mark: " << pRenderer->GetWorkerArenaHighWaterMark() / 1024 << " KB" << std::endl;
+
 	//Shutdown "framework"
 	delete pRenderer;
 	delete pTimer;